@@ -59,5 +59,14 @@
 #define SYSCALL_FS_LN 77
 #define SYSCALL_FS_RM 78
 #define SYSCALL_FS_LSEEK 79
+#define SYSCALL_FS_SYNC 80
+#define SYSCALL_MMAP 81
+#define SYSCALL_MUNMAP 82
+#define SYSCALL_MSYNC 83
+#define SYSCALL_FORK 84
+#define SYSCALL_SETPRIORITY 85
+#define SYSCALL_USLEEP 86
+#define SYSCALL_FUTEX_WAIT 87
+#define SYSCALL_FUTEX_WAKE 88
 
 #endif
\ No newline at end of file
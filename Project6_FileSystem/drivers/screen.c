@@ -16,6 +16,8 @@ char old_screen[SCREEN_HEIGHT * SCREEN_WIDTH] = {0};
 
 int scroll_base = 0;
 
+spin_lock_t screen_lock;
+
 /* cursor position */
 static void vt100_move_cursor(int x, int y) {
     // \033[y;xH
@@ -0,0 +1,38 @@
+#ifndef __INCLUDE_OS_BLK_H__
+#define __INCLUDE_OS_BLK_H__
+
+#include <type.h>
+#include <os/list.h>
+
+/* block request queue in front of bios_sdread / bios_sdwrite */
+#define BLK_MAX_SECT 64      // sectors per bios call, see loader.c
+#define BLK_DRAIN_BATCH 4    // dispatches per timer tick
+#define BLK_DEADLINE 1       // seconds a request may wait in the queue
+
+#define BLK_READ  0
+#define BLK_WRITE 1
+
+#define BLK_PENDING 0x7fffffff  /* status before completion, then bios return value */
+
+typedef struct blk_req {
+    int dir;
+    uint32_t sector;
+    uint32_t nsect;
+    uintptr_t kva;      // NOTE: must stay valid until the request is done
+    volatile int status;
+    uint64_t submit;    // ticks, for deadline
+    void (*done)(struct blk_req *);  // called on completion, can be NULL
+    list_node_t list;   // sorted by sector in the queue
+} blk_req_t;
+
+extern int blk_dispatch;
+extern int blk_merged;
+
+void blk_submit(blk_req_t *req);
+int blk_wait(blk_req_t *req);
+int blk_read(uintptr_t kva, uint32_t nsect, uint32_t sector);
+int blk_write(uintptr_t kva, uint32_t nsect, uint32_t sector);
+void blk_drain(void);
+void check_blk_queue(void);
+
+#endif  // !__INCLUDE_OS_BLK_H__
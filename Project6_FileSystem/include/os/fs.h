@@ -2,10 +2,12 @@
 #define __INCLUDE_OS_FS_H__
 
 #include <type.h>
+#include <os/list.h>
 
 /* macros of file system */
 #define SUPERBLOCK_MAGIC 0x20221205
-#define NUM_FDESCS 16
+#define NUM_FDESCS 16  // per process
+#define FILE_TABLE_CHUNK 32
 #define FS_START 0x20000
 #define SECTOR_SIZE 512
 #define BLOCK_SIZE_BYTE 0x1000 // 4KB
@@ -14,6 +16,8 @@
 #define MAX_INODE_NUM 0x8000
 #define MAX_BLOCK_MAP_SIZE (MAX_BLOCK_NUM / BLOCK_SIZE_BYTE / 8)
 #define MAX_INODE_MAP_SIZE (MAX_INODE_NUM / BLOCK_SIZE_BYTE / 8)
+#define JOURNAL_OFFSET 1   // right after superblock, fixed so that replay needs no superblock
+#define JOURNAL_SIZE 128   // header + logged blocks
 
 /* Rounding; only works for n = power of two */
 #define ROUND(a, n)     (((((uint64_t)(a))+(n)-1)) & ~((n)-1))
@@ -32,6 +36,9 @@ typedef struct superblock_t {
     int block_num;
     uint32_t inode_offset;
     uint32_t data_offset;
+    uint32_t journal_offset;
+    uint32_t journal_size;
+    int mapping;  // how file blocks are mapped, chosen at mkfs
     int magic1;
 } superblock_t;
 
@@ -42,11 +49,52 @@ typedef struct dentry_t {
     int valid;
 } dentry_t;
 
+#define DENTRY_PER_BLOCK (BLOCK_SIZE_BYTE / sizeof(dentry_t))
+
+typedef struct dindex_entry_t {
+    uint32_t hash;  // lowest name hash this leaf holds
+    int block_no;   // leaf's block no in the directory
+} dindex_entry_t;
+
+#define DINDEX_ENTRY_NUM (BLOCK_SIZE_BYTE / sizeof(dindex_entry_t) - 1)
+typedef struct dindex_t {
+    // NOTE: block 0 of every directory, entries are sorted by hash and entries[0].hash is 0
+    int num;
+    int reserved;
+    dindex_entry_t entries[DINDEX_ENTRY_NUM];
+} dindex_t;
+
 #define DIRECT_BLOCK_NUM 8
 #define INDIRECT_BLOCK_L1_NUM 3
 #define INDIRECT_BLOCK_L2_NUM 2
 #define INDIRECT_BLOCK_L3_NUM 1
 
+/* mapping of superblock */
+#define FS_MAP_INDIRECT 0  /* direct + l1/l2/l3 indirect blocks */
+#define FS_MAP_EXTENT   1  /* extents for files, dirs still use direct blocks */
+
+typedef struct extent_t {
+    int start;  // first logical block no
+    int block;  // first physical block
+    int len;
+} extent_t;
+
+#define INODE_EXTENT_NUM 4
+
+// more extents go to leaf blocks, found through an index block
+#define EXTENT_LEAF_NUM ((BLOCK_SIZE_BYTE - sizeof(int)) / sizeof(extent_t))
+typedef struct extent_leaf_t {
+    int num;
+    extent_t extents[EXTENT_LEAF_NUM];  // sorted by start
+} extent_leaf_t;
+
+typedef struct extent_idx_t {
+    int start;  // first logical block no of the leaf, the first leaf also takes those before it
+    int block;  // leaf block
+} extent_idx_t;
+
+#define EXTENT_IDX_NUM (BLOCK_SIZE_BYTE / sizeof(extent_idx_t))
+
 #define INODE_FILE 0
 #define INODE_DIR  1
 typedef struct inode_t {
@@ -54,19 +102,38 @@ typedef struct inode_t {
     short type;
     short link;
     int size;
-    int direct_blocks[DIRECT_BLOCK_NUM];
-    int indirect_blocks_l1[INDIRECT_BLOCK_L1_NUM];
-    int indirect_blocks_l2[INDIRECT_BLOCK_L2_NUM];
-    int indirect_blocks_l3[INDIRECT_BLOCK_L3_NUM];
+    union {
+        struct {
+            int direct_blocks[DIRECT_BLOCK_NUM];
+            int indirect_blocks_l1[INDIRECT_BLOCK_L1_NUM];
+            int indirect_blocks_l2[INDIRECT_BLOCK_L2_NUM];
+            int indirect_blocks_l3[INDIRECT_BLOCK_L3_NUM];
+        };
+        struct {
+            // sorted by start, moved to a leaf under extent_block when inode is full
+            // extent_num counts the extents, or the leaves once extent_block != -1
+            extent_t extents[INODE_EXTENT_NUM];
+            int extent_num;
+            int extent_block;
+        };
+    };
 } inode_t;
 
-typedef struct fdesc_t {
+#define INODE_PER_BLOCK (BLOCK_SIZE_BYTE / sizeof(inode_t))
+
+typedef struct file_t {
+    // NOTE: entry of system-wide open-file table, shared by fds through ref
     int ino;
+    inode_t *inode;  // held by iget() while opened
     int wp;
     int rp;
     int mode;
-    pid_t owner;
-} fdesc_t;
+    int ref;
+    int ra_pos;   // rp after last read, a read starting here is sequential
+    int ra_size;  // readahead window in blocks, 0 before a sequential read
+    int ra_end;   // blocks before it have been prefetched
+    list_node_t list;  // in free list when ref == 0
+} file_t;
 
 /* modes of do_fopen */
 #define O_RDONLY 1  /* read only open */
@@ -77,10 +144,103 @@ typedef struct fdesc_t {
 #define SEEK_SET 0
 #define SEEK_CUR 1
 #define SEEK_END 2
+#define SEEK_DATA 3  /* next offset with data */
+#define SEEK_HOLE 4  /* next offset in a hole */
+
+/* buffer cache */
+struct page_t;
+#define NUM_BCACHE 64            // at most, pages are shared with user and reclaimed
+#define BCACHE_RESERVE 8         // never reclaimed below this
+#define BCACHE_FLUSH_INTERVAL 5 // seconds
+#define MAX_BLOCK_RW 8          // 64 sectors per bios call, see loader.c
+#define READAHEAD_MIN 4         // blocks
+#define READAHEAD_MAX 16
+#define BCACHE_DIRTY_LIMIT (NUM_BCACHE / 2)  // committed at the end of an operation beyond this
+
+extern int bcache_hit;
+extern int bcache_miss;
+extern int bcache_writeback;
+extern int bcache_batch;
+extern int bcache_prefetched;
+extern int bcache_pages;
+
+void init_bcache(void);
+void *bcache_get(int offset);
+void *bcache_new(int offset);
+void bcache_dirty(int offset);
+void bcache_pin(int offset);
+void bcache_unpin(int offset);
+void bcache_prefetch(int offset);
+void bcache_read_blocks(int offset, int num, uint8_t *buf);
+void bcache_write_blocks(int offset, int num, const uint8_t *buf);
+void bcache_sync(void);
+int bcache_ndirty(void);
+void bcache_invalidate(void);
+int bcache_reclaim(struct page_t *page);
+void check_bcache_flush(void);
+
+/* metadata journal */
+extern int journal_commits;
+
+void init_journal(void);
+void journal_commit(int num, int *offsets, uint8_t **data);
+void journal_clear(void);
+int fs_commit(void);
+void fs_commit_point(void);
+
+/* delayed allocation */
+#define NUM_DELALLOC 32
+#define DELALLOC_RESERVE 4  // blocks reserved by a delayed one, itself and l1-l3 indirect blocks
+
+int delalloc_sync(void);
+
+/* in-core inode cache */
+#define NUM_ICACHE 128
+
+extern int icache_hit;
+extern int icache_miss;
+
+void init_icache(uint32_t offset);
+inode_t *icache_get(int ino);
+void icache_dirty(int ino);
+inode_t *iget(int ino);
+void iput(int ino);
+void icache_sync(void);
+
+/* directory entry cache */
+#define NUM_DCACHE 128
+#define DCACHE_NAME_LEN 56  // same as dentry_t.name
+
+extern int dcache_hit;
+extern int dcache_miss;
+
+void init_dcache(void);
+int dcache_lookup(int pino, const char *name, int len, int *ino);
+void dcache_insert(int pino, const char *name, int len, int ino);
+void dcache_remove(int pino, const char *name);
+void dcache_remove_dir(int ino);
+void dcache_invalidate(void);
+
+/* bitmap allocator */
+typedef struct bitmap_t {
+    // NOTE: resident copy of inode map / block map, offset / size's unit is block
+    uint64_t *map;
+    uint32_t offset;
+    uint32_t size;
+    int free[MAX_BLOCK_MAP_SIZE];   // free bits of each bitmap block
+    int dirty[MAX_BLOCK_MAP_SIZE];  // bitmap block changed since last sync
+    int hint;                       // next-fit, word index of last allocation
+} bitmap_t;
+
+void init_bitmap(bitmap_t *bm, uint32_t offset, uint32_t size, int clear);
+int bitmap_alloc(bitmap_t *bm);
+int bitmap_alloc_at(bitmap_t *bm, int idx);
+int bitmap_free(bitmap_t *bm, int idx);
+void bitmap_sync(bitmap_t *bm);
 
 /* fs function declarations */
 void init_fs(void);
-extern int do_mkfs(void);
+extern int do_mkfs(int option);
 extern int do_statfs(void);
 extern int do_cd(char *path);
 extern int do_mkdir(char *path);
@@ -95,5 +255,13 @@ extern int do_fclose(int fd);
 extern int do_ln(char *src_path, char *dst_path);
 extern int do_rm(char *path);
 extern int do_lseek(int fd, int offset, int whence);
+extern int do_sync(void);
+void close_all_files(file_t **fdtable);
+void dup_all_files(file_t **dst, file_t **src);
+int fs_hold_file(int fd, int *writable);
+void fs_dup_file(int ino);
+void fs_release_file(int ino);
+void fs_read_page(int ino, int offset, uint8_t *page);
+int fs_write_page(int ino, int offset, const uint8_t *page);
 
 #endif
\ No newline at end of file
@@ -58,6 +58,8 @@ void spin_lock_init(spin_lock_t *lock);
 int spin_lock_try_acquire(spin_lock_t *lock);
 void spin_lock_acquire(spin_lock_t *lock);
 void spin_lock_release(spin_lock_t *lock);
+void task_lock(spin_lock_t *lock);
+void task_unlock(spin_lock_t *lock);
 
 int do_mutex_lock_init(int key);
 void do_mutex_lock_acquire(int mlock_idx);
@@ -94,6 +96,18 @@ void do_condition_signal(int cond_idx);
 void do_condition_broadcast(int cond_idx);
 void do_condition_destroy(int cond_idx);
 
+typedef struct futex {
+    list_head block_queue;  // in use while it has waiters
+    uint64_t pgdir;         // 0 for shm
+    uintptr_t addr;         // va, or kva for shm
+} futex_t;
+
+#define FUTEX_NUM 32
+
+void init_futexes(void);
+int do_futex_wait(uint32_t *addr, uint32_t val);
+int do_futex_wake(uint32_t *addr, int num);
+
 #define MAX_MBOX_LENGTH (64)
 
 typedef struct mailbox {
@@ -101,7 +115,7 @@ typedef struct mailbox {
     char buf[MAX_MBOX_LENGTH+1];
     int size;
     int rp;
-    mutex_lock_t lock;
+    spin_lock_t lock;
     condition_t empty, full;
     int allocated;
 } mailbox_t;
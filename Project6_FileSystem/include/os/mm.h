@@ -37,13 +37,15 @@
 #define PAGE_SIZE 4096 // 4K
 #define INIT_KERNEL_STACK 0xffffffc052000000
 #define FREEMEM_KERNEL (INIT_KERNEL_STACK+4*PAGE_SIZE)
+#define MEM_BASE 0xffffffc050000000lu  // all physical memory is mapped by setup_vm()
+#define MEM_END  0xffffffc060000000lu
+#define BUDDY_MAX_ORDER 10             // 4MB
 
 typedef struct {
     unsigned int pa; // block id
-    list_node_t list;
 } swap_t;
 
-typedef struct {
+typedef struct page_t {
     ptr_t kva;
     ptr_t va;
     list_node_t list;
@@ -53,7 +55,9 @@ typedef struct {
     enum {
         PAGE_USER,
         PAGE_KERNEL,
-        PAGE_SHM
+        PAGE_SHM,
+        PAGE_MMAP,
+        PAGE_CACHE  // block of buffer cache, see bcache.c
     } tp;
 } page_t;
 
@@ -63,16 +67,28 @@ extern list_head onmem_list;
 #define ROUND(a, n)     (((((uint64_t)(a))+(n)-1)) & ~((n)-1))
 #define ROUNDDOWN(a, n) (((uint64_t)(a)) & ~((n)-1))
 
+void init_mm(void);
 ptr_t allocPage(int numPage);
+void freePage(ptr_t baseAddr, int numPage);
+void frame_get(uintptr_t kva);
+int frame_put(uintptr_t kva);
+int frame_shared(uintptr_t kva);
 page_t *alloc_page1(void);
 void free_page1(page_t *page);
+page_t *new_page_struct(void);
+void put_page_struct(page_t *page);
+// reclaim: 0 free frames only, 1 may swap out, RECLAIM_NOFS may swap out but
+// not write mapped pages back to files, for the fs itself
+#define RECLAIM_NOFS 2
+uintptr_t get_frame(int reclaim);
+void put_frame(uintptr_t kva);
+page_t *alloc_frame(int tp, int reclaim);
 
 void do_garbage_collector(void);
 
 // #define S_CORE
 // NOTE: only need for S-core to alloc 2MB large page
 #ifdef S_CORE
-#define LARGE_PAGE_FREEMEM 0xffffffc056000000
 #define USER_STACK_ADDR 0x400000
 ptr_t allocLargePage(int numPage);
 #else
@@ -81,14 +97,16 @@ ptr_t allocLargePage(int numPage);
 #endif
 
 void *kmalloc(size_t size);
+void kfree(void *ptr);
 void share_pgtable(uintptr_t dest_pgdir, uintptr_t src_pgdir);
 list_node_t *get_page_list(pcb_t *pcb);
 PTE *map_page(uintptr_t va, uint64_t pgdir, list_node_t *page_list, int level);
 uintptr_t alloc_page_helper(uintptr_t va, pcb_t *pcb);
 
 // swap
+#define SWAP_CLUSTER 4  // pages evicted / read ahead together
 void free_swap1(swap_t *swap);
-uintptr_t swap_out();
+uintptr_t swap_out(int fs);
 void swap_in(page_t *page, uintptr_t kva);
 page_t *check_and_swap(pcb_t *pcb, uintptr_t va);
 
@@ -109,6 +127,38 @@ typedef struct {
 void init_shm_pages();
 uintptr_t shm_page_get(int key);
 void shm_page_dt(uintptr_t addr);
+int is_shm_addr(uintptr_t va);
+int shm_fork(pcb_t *dst, pcb_t *src);
+
+// mmap
+#define MMAP_AREA_NUM 32
+typedef struct {
+    int valid;
+    pid_t pid;       // owner process
+    uintptr_t va;    // page aligned
+    int len;         // bytes, multiple of PAGE_SIZE
+    int ino;         // held by the mapping until munmap
+    int offset;      // file offset of va, multiple of PAGE_SIZE
+    int writable;
+} mmap_area_t;
+
+uintptr_t do_mmap(int fd, int offset, int length);
+int do_munmap(uintptr_t addr);
+int do_msync(uintptr_t addr);
+int mmap_fault(pcb_t *pcb, uintptr_t va, int write);
+int is_mmap_addr(pcb_t *pcb, uintptr_t va);
+uintptr_t mmap_reclaim(page_t *page, PTE *pte, int fs);
+void munmap_all(pcb_t *pcb);
+int mmap_fork(pcb_t *dst, pcb_t *src);
+
+// copy-on-write
+#define _PAGE_COW _PAGE_SOFT  // write protected because the frame is shared by fork
+int copy_user_pages(pcb_t *dst, pcb_t *src);
+int cow_fault(pcb_t *pcb, uintptr_t va);
+
+// tlb shootdown
+void flush_tlb_other_harts(uintptr_t pgdir);
+void tlb_flush_ack(void);
 
 // snapshot
 uint64_t do_snapshot(uint64_t va);
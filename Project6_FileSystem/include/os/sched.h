@@ -31,9 +31,19 @@
 
 #include <type.h>
 #include <os/list.h>
+#include <os/lock.h>
+#include <os/smp.h>
+#include <os/fs.h>
 
 #define NUM_MAX_TASK 128
 
+/* fair scheduler: the ready queue is sorted by vruntime, which grows slower for a lower nice
+ * undefine it for round robin, nice is ignored then
+ */
+#define SCHED_FAIR
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+
 /* used to save register infomation */
 typedef struct regs_context
 {
@@ -122,20 +132,31 @@ typedef struct pcb
 
     /* BLOCK | READY | RUNNING */
     task_status_t status;
+    /* EXITED and cleaned up by do_garbage_collector(), the slot can be reused */
+    int collected;
 
     /* cursor position */
     int cursor_x;
     int cursor_y;
 
-    /* time(seconds) to wake up sleeping PCB */
+    /* time(ticks) to wake up sleeping PCB, and its index in the sleep heap (0: not sleeping) */
     uint64_t wakeup_time;
-} pcb_t;
+    int sleep_idx;
+
+    /* priority, NICE_MIN ~ NICE_MAX, and ticks of cpu time weighted by it */
+    int nice;
+    uint64_t vruntime;
+    uint64_t exec_start;
 
-/* ready queue to run */
-extern list_head ready_queue;
+    /* kernel lock held by the syscall, dropped while blocked, see do_scheduler() */
+    spin_lock_t *lock;
+
+    /* opened files, only valid for TYPE_PROCESS, threads use their process's */
+    file_t *fdtable[NUM_FDESCS];
+} pcb_t;
 
-/* sleep queue to be blocked in */
-extern list_head sleep_queue;
+/* ready queue to run, one for each hart, see ready_enqueue() */
+extern list_head ready_queue[NR_CPUS];
 
 /* current running task PCB */
 extern pcb_t * volatile current_running[2];
@@ -146,6 +167,7 @@ extern pcb_t pid0_pcb[2];
 extern const ptr_t pid0_stack[2];
 
 int new_pcb_idx();
+void put_pcb_idx(int idx);
 
 // #define S_CORE_P3
 
@@ -154,7 +176,9 @@ void init_pcbs(void);
 extern void switch_to(pcb_t *prev, pcb_t *next);
 void do_scheduler(void);
 void do_sleep(uint32_t);
+void do_usleep(uint64_t usec);
 
+void ready_enqueue(pcb_t *pcb);
 void do_block(pcb_t *, list_head *queue);
 void do_unblock(list_node_t *);
 
@@ -164,6 +188,7 @@ pid_t do_exec(int id, int argc, uint64_t arg0, uint64_t arg1, uint64_t arg2);
 #else
 pid_t do_exec(char *name, int argc, char *argv[]);
 #endif
+pid_t do_fork(void);
 void do_exit(void);
 int do_kill(pid_t pid);
 int do_waitpid(pid_t pid);
@@ -171,5 +196,6 @@ void do_process_show();
 pid_t do_getpid();
 
 void do_taskset(pid_t pid, unsigned mask);
+int do_setpriority(pid_t pid, int nice);
 
 #endif
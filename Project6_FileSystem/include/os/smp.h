@@ -1,11 +1,20 @@
-#ifndef SMP_H
-#define SMP_H
-
-#define NR_CPUS 2
-extern void smp_init();
-extern void wakeup_other_hart();
-extern uint64_t get_current_cpu_id();
-extern void lock_kernel();
-extern void unlock_kernel();
-
-#endif /* SMP_H */
+#ifndef SMP_H
+#define SMP_H
+
+#include <os/lock.h>
+
+#define NR_CPUS 2
+extern void smp_init();
+extern void wakeup_other_hart();
+extern uint64_t get_current_cpu_id();
+
+/* kernel locks, a syscall takes the one in syscall_lock[], see init_syscall()
+ * nesting order: mm_lock -> sync_lock -> mailbox -> net_lock -> sched_lock -> screen_lock
+ */
+extern spin_lock_t sched_lock;   // ready/sleep queue, pcb status & list
+extern spin_lock_t mm_lock;      // memory, swap, buffer cache and fs, they share frames
+extern spin_lock_t sync_lock;    // mutex, barrier, condition and mailbox table
+extern spin_lock_t net_lock;     // e1000 rings
+extern spin_lock_t screen_lock;  // screen buffer
+
+#endif /* SMP_H */
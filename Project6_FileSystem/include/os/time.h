@@ -42,4 +42,10 @@ extern void latency(uint64_t time);
 
 extern void check_sleeping(void);
 
+/* sleeping tasks, a min heap on wakeup_time, protected by sched_lock */
+struct pcb;
+extern void sleep_enqueue(struct pcb *pcb);
+extern void sleep_dequeue(struct pcb *pcb);
+extern uint64_t next_wakeup(void);
+
 #endif
@@ -36,6 +36,8 @@
 
 /* syscall function pointer */
 extern long (*syscall[NUM_SYSCALLS])();
+/* kernel lock held during a syscall, NULL if it needs none or locks by itself */
+extern spin_lock_t *syscall_lock[NUM_SYSCALLS];
 extern void handle_syscall(regs_context_t *regs, uint64_t stval, uint64_t scause);
 
 #endif
@@ -187,6 +187,65 @@ static void init_syscall(void) {
     syscall[SYSCALL_FS_LN]         = (long (*)()) do_ln;
     syscall[SYSCALL_FS_RM]         = (long (*)()) do_rm;
     syscall[SYSCALL_FS_LSEEK]      = (long (*)()) do_lseek;
+    syscall[SYSCALL_FS_SYNC]       = (long (*)()) do_sync;
+    syscall[SYSCALL_MMAP]          = (long (*)()) do_mmap;
+    syscall[SYSCALL_MUNMAP]        = (long (*)()) do_munmap;
+    syscall[SYSCALL_MSYNC]         = (long (*)()) do_msync;
+    syscall[SYSCALL_FORK]          = (long (*)()) do_fork;
+    syscall[SYSCALL_SETPRIORITY]   = (long (*)()) do_setpriority;
+    syscall[SYSCALL_USLEEP]        = (long (*)()) do_usleep;
+    syscall[SYSCALL_FUTEX_WAIT]    = (long (*)()) do_futex_wait;
+    syscall[SYSCALL_FUTEX_WAKE]    = (long (*)()) do_futex_wake;
+
+    // kernel lock of each syscall, see include/os/smp.h
+    // NULL: touches nothing shared, or takes its own lock (sleep, yield, mbox send / recv)
+    for (int i=0; i<NUM_SYSCALLS; i++)
+        syscall_lock[i] = NULL;
+    // process management allocates pages and closes files
+    syscall_lock[SYSCALL_EXEC]          = &mm_lock;
+    syscall_lock[SYSCALL_EXIT]          = &mm_lock;
+    syscall_lock[SYSCALL_KILL]          = &mm_lock;
+    syscall_lock[SYSCALL_WAITPID]       = &mm_lock;
+    syscall_lock[SYSCALL_PTHREAD_CREATE]= &mm_lock;
+    syscall_lock[SYSCALL_PTHREAD_JOIN]  = &mm_lock;
+    syscall_lock[SYSCALL_PTHREAD_EXIT]  = &mm_lock;
+    syscall_lock[SYSCALL_FORK]          = &mm_lock;
+    // ps only reads pcbs, taskset and setpriority take sched_lock themselves,
+    // they don't wait behind fs operations in mm_lock
+    syscall_lock[SYSCALL_PS]            = NULL;
+    syscall_lock[SYSCALL_TASKSET]       = NULL;
+    syscall_lock[SYSCALL_SETPRIORITY]   = NULL;
+    // screen
+    syscall_lock[SYSCALL_WRITE]         = &screen_lock;
+    syscall_lock[SYSCALL_CURSOR]        = &screen_lock;
+    syscall_lock[SYSCALL_REFLUSH]       = &screen_lock;
+    syscall_lock[SYSCALL_CLEAR]         = &screen_lock;
+    syscall_lock[SYSCALL_CURSOR_R]      = &screen_lock;
+    syscall_lock[SYSCALL_SET_SC_BASE]   = &screen_lock;
+    // mutex, barrier, condition, mailbox table
+    for (int i=SYSCALL_LOCK_INIT; i<=SYSCALL_LOCK_RELEASE; i++)
+        syscall_lock[i] = &sync_lock;
+    for (int i=SYSCALL_BARR_INIT; i<=SYSCALL_COND_DESTROY; i++)
+        syscall_lock[i] = &sync_lock;
+    syscall_lock[SYSCALL_MBOX_OPEN]     = &sync_lock;
+    syscall_lock[SYSCALL_MBOX_CLOSE]    = &sync_lock;
+    // memory
+    syscall_lock[SYSCALL_SHM_GET]       = &mm_lock;
+    syscall_lock[SYSCALL_SHM_DT]        = &mm_lock;
+    syscall_lock[SYSCALL_SNAPSHOT]      = &mm_lock;
+    syscall_lock[SYSCALL_GETPA]         = &mm_lock;
+    syscall_lock[SYSCALL_MMAP]          = &mm_lock;
+    syscall_lock[SYSCALL_MUNMAP]        = &mm_lock;
+    syscall_lock[SYSCALL_MSYNC]         = &mm_lock;
+    // futex keys come from the page table
+    syscall_lock[SYSCALL_FUTEX_WAIT]    = &mm_lock;
+    syscall_lock[SYSCALL_FUTEX_WAKE]    = &mm_lock;
+    // network
+    syscall_lock[SYSCALL_NET_SEND]      = &net_lock;
+    syscall_lock[SYSCALL_NET_RECV]      = &net_lock;
+    // file system
+    for (int i=SYSCALL_FS_MKFS; i<=SYSCALL_FS_SYNC; i++)
+        syscall_lock[i] = &mm_lock;
 }
 
 void init_shell(void) {
@@ -209,6 +268,10 @@ int main(void) {
         init_jmptab();
         logging(LOG_INFO, "init", "Jump table initialization succeeded.\n");
 
+        // Init physical page allocator
+        init_mm();
+        logging(LOG_INFO, "init", "Memory initialization succeeded.\n");
+
         // Init task information (〃'▽'〃)
         init_task_info();
         logging(LOG_INFO, "init", "Task info loaded, apps=%d, batches=%d.\n", appnum, batchnum);
@@ -240,6 +303,7 @@ int main(void) {
         init_locks();
         init_barriers();
         init_conditions();
+        init_futexes();
         init_mbox();
         logging(LOG_INFO, "init", "Lock mechanism initialization succeeded.\n");
 
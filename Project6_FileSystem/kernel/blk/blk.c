@@ -0,0 +1,155 @@
+#include <os/blk.h>
+#include <os/kernel.h>
+#include <os/mm.h>
+#include <os/string.h>
+#include <os/time.h>
+#include <printk.h>
+#include <pgtable.h>
+
+#define SECTOR_SIZE 512
+
+/* NOTE: bios calls are synchronous and have no completion interrupt,
+ * a request is done when it's dispatched by a waiter, blk_drain() or the timer
+ */
+
+// pending requests, sorted by sector
+static LIST_HEAD(blk_queue);
+// sector right after the last dispatch, elevator goes up from here
+static uint32_t blk_head = 0;
+// contiguous pages for merged requests
+static uint8_t *blk_bounce = NULL;
+
+// statistics, shown in statfs
+int blk_dispatch = 0;
+int blk_merged = 0;
+
+static int blk_conflict(blk_req_t *a, blk_req_t *b) {
+    // reordering is only unsafe when they overlap and one of them writes
+    return (a->dir == BLK_WRITE || b->dir == BLK_WRITE) &&
+           a->sector < b->sector + b->nsect && b->sector < a->sector + a->nsect;
+}
+
+static void blk_do(blk_req_t *first) {
+    // merge following requests in the same direction which continue the sectors
+    // NOTE: every request has nsect <= BLK_MAX_SECT
+    blk_req_t *reqs[BLK_MAX_SECT];
+    int num = 0;
+    uint32_t nsect = 0;
+    for (blk_req_t *r=first; ; ) {
+        reqs[num++] = r;
+        nsect += r->nsect;
+        if (r->list.next == &blk_queue)
+            break;
+        blk_req_t *next = list_entry(r->list.next, blk_req_t, list);
+        if (next->dir != first->dir || next->sector != r->sector + r->nsect ||
+            nsect + next->nsect > BLK_MAX_SECT)
+            break;
+        r = next;
+    }
+    for (int i=0; i<num; i++)
+        list_delete(&reqs[i]->list);
+
+    int ret;
+    if (num == 1) {
+        ret = first->dir == BLK_WRITE ? bios_sdwrite(kva2pa(first->kva), nsect, first->sector)
+                                      : bios_sdread(kva2pa(first->kva), nsect, first->sector);
+    } else {
+        if (blk_bounce == NULL)
+            blk_bounce = (uint8_t *) allocPage(BLK_MAX_SECT * SECTOR_SIZE / PAGE_SIZE);
+        if (first->dir == BLK_WRITE) {
+            for (int i=0, off=0; i<num; off+=reqs[i++]->nsect)
+                memcpy(blk_bounce + off * SECTOR_SIZE, (uint8_t *) reqs[i]->kva, reqs[i]->nsect * SECTOR_SIZE);
+            ret = bios_sdwrite(kva2pa((uintptr_t) blk_bounce), nsect, first->sector);
+        } else {
+            ret = bios_sdread(kva2pa((uintptr_t) blk_bounce), nsect, first->sector);
+            for (int i=0, off=0; i<num; off+=reqs[i++]->nsect)
+                memcpy((uint8_t *) reqs[i]->kva, blk_bounce + off * SECTOR_SIZE, reqs[i]->nsect * SECTOR_SIZE);
+        }
+        blk_merged += num - 1;
+        logging(LOG_VV, "blk", "merged %d requests at 0x%x, %d sectors\n", num, first->sector, nsect);
+    }
+    blk_dispatch ++;
+    blk_head = first->sector + nsect;
+
+    // NOTE: callbacks may submit new requests
+    for (int i=0; i<num; i++) {
+        reqs[i]->status = ret;
+        if (reqs[i]->done != NULL)
+            reqs[i]->done(reqs[i]);
+    }
+}
+
+static blk_req_t *blk_next(int *expired) {
+    // deadline: the oldest request goes first once it has waited too long
+    // otherwise C-LOOK: the lowest sector above head, wrap to the lowest one
+    blk_req_t *oldest = NULL, *next = NULL;
+    for (list_node_t *p=blk_queue.next; p!=&blk_queue; p=p->next) {
+        blk_req_t *r = list_entry(p, blk_req_t, list);
+        if (oldest == NULL || r->submit < oldest->submit)
+            oldest = r;
+        if (next == NULL && r->sector >= blk_head)
+            next = r;
+    }
+    *expired = oldest != NULL && get_ticks() - oldest->submit >= BLK_DEADLINE * time_base;
+    if (*expired)
+        return oldest;
+    if (next == NULL && !list_is_empty(&blk_queue))
+        next = list_entry(blk_queue.next, blk_req_t, list);
+    return next;
+}
+
+void blk_submit(blk_req_t *req) {
+    // a request never passes a conflicting one, finish the queue first
+    for (list_node_t *p=blk_queue.next; p!=&blk_queue; p=p->next) {
+        if (blk_conflict(req, list_entry(p, blk_req_t, list))) {
+            blk_drain();
+            break;
+        }
+    }
+    req->status = BLK_PENDING;
+    req->submit = get_ticks();
+    list_node_t *p = blk_queue.next;
+    while (p != &blk_queue && list_entry(p, blk_req_t, list)->sector <= req->sector)
+        p = p->next;
+    list_insert(p->prev, &req->list);
+}
+
+int blk_wait(blk_req_t *req) {
+    // a waiter doesn't queue behind background requests, dispatch it right now
+    if (req->status == BLK_PENDING)
+        blk_do(req);
+    return req->status;
+}
+
+static int blk_rw(int dir, uintptr_t kva, uint32_t nsect, uint32_t sector) {
+    blk_req_t req;
+    req.dir = dir;
+    req.sector = sector;
+    req.nsect = nsect;
+    req.kva = kva;
+    req.done = NULL;
+    list_init(&req.list);
+    blk_submit(&req);
+    return blk_wait(&req);
+}
+
+int blk_read(uintptr_t kva, uint32_t nsect, uint32_t sector) {
+    return blk_rw(BLK_READ, kva, nsect, sector);
+}
+
+int blk_write(uintptr_t kva, uint32_t nsect, uint32_t sector) {
+    return blk_rw(BLK_WRITE, kva, nsect, sector);
+}
+
+void blk_drain(void) {
+    int expired;
+    while (!list_is_empty(&blk_queue))
+        blk_do(blk_next(&expired));
+}
+
+void check_blk_queue(void) {
+    // called by timer, a few dispatches per tick, more if requests are overdue
+    int expired = 0;
+    for (int i=0; !list_is_empty(&blk_queue) && (i < BLK_DRAIN_BATCH || expired); i++)
+        blk_do(blk_next(&expired));
+}
@@ -0,0 +1,372 @@
+#include <assert.h>
+#include <os/blk.h>
+#include <os/fs.h>
+#include <os/kernel.h>
+#include <os/list.h>
+#include <os/mm.h>
+#include <os/string.h>
+#include <os/time.h>
+#include <printk.h>
+
+#define BCACHE_HASH_SIZE NUM_BCACHE
+
+typedef struct bcache {
+    // NOTE: offset's unit is block, relative to FS_START
+    int offset;
+    int dirty;
+    int pin;
+    int io;  // prefetch in flight, data is not valid yet
+    blk_req_t req;
+    page_t *page;   // frame shared with user pages, NULL if the slot is empty
+    uint8_t *data;  // page->kva
+    list_node_t lru;
+    list_node_t hash;
+} bcache_t;
+
+static bcache_t bcache[NUM_BCACHE];
+
+// most recently used at head, victim taken from tail
+static LIST_HEAD(bcache_lru);
+static list_head bcache_hash[BCACHE_HASH_SIZE];
+
+// contiguous pages for multi-block transfer
+static uint8_t *bcache_bounce;
+
+// committed blocks on their way home, written asynchronously from a copy
+static uint8_t *ckpt_data;
+static blk_req_t ckpt_req[NUM_BCACHE];
+static int ckpt_pending = 0;
+
+static int bcache_inited = 0;
+static int bcache_committing = 0;
+static uint64_t last_flush = 0;
+
+// statistics, shown in statfs
+int bcache_hit = 0;
+int bcache_miss = 0;
+int bcache_writeback = 0;
+int bcache_batch = 0;
+int bcache_prefetched = 0;
+int bcache_pages = 0;
+
+static int read_cache(bcache_t *b) {
+    bcache_miss ++;
+    return blk_read((uintptr_t) b->data, BLOCK_SIZE, FS_START + b->offset * BLOCK_SIZE);
+}
+
+void init_bcache(void) {
+    // NOTE: BLOCK_SIZE_BYTE == PAGE_SIZE, one page per cache entry
+    // pages are taken from the frames shared with user when needed, see mm.c
+    for (int i=0; i<BCACHE_HASH_SIZE; i++)
+        list_init(&bcache_hash[i]);
+    for (int i=0; i<NUM_BCACHE; i++) {
+        bcache[i].offset = -1;
+        bcache[i].dirty = 0;
+        bcache[i].pin = 0;
+        bcache[i].io = 0;
+        bcache[i].page = NULL;
+        bcache[i].data = NULL;
+        list_init(&bcache[i].hash);
+        list_insert(bcache_lru.prev, &bcache[i].lru);
+    }
+    bcache_bounce = (uint8_t *) allocPage(MAX_BLOCK_RW);
+    ckpt_data = (uint8_t *) allocPage(NUM_BCACHE);
+    last_flush = get_ticks();
+    bcache_inited = 1;
+    logging(LOG_INFO, "bcache", "up to %d blocks\n", NUM_BCACHE);
+}
+
+static bcache_t *bcache_lookup(int offset) {
+    list_head *head = &bcache_hash[offset % BCACHE_HASH_SIZE];
+    for (list_node_t *p=head->next; p!=head; p=p->next) {
+        bcache_t *b = list_entry(p, bcache_t, hash);
+        if (b->offset == offset)
+            return b;
+    }
+    return NULL;
+}
+
+static void bcache_touch(bcache_t *b) {
+    list_delete(&b->lru);
+    list_insert(&bcache_lru, &b->lru);
+    // also the newest page for reclaim
+    list_delete(&b->page->onmem);
+    list_insert(onmem_list.prev, &b->page->onmem);
+}
+
+static bcache_t *bcache_grow(int reclaim) {
+    // an empty slot with a new frame, which may be reclaimed from the oldest page of anyone
+    for (int i=0; i<NUM_BCACHE; i++) {
+        if (bcache[i].page != NULL)
+            continue;
+        // the fs may be in the middle of an operation, mapped pages can't be written back
+        page_t *page = alloc_frame(PAGE_CACHE, reclaim ? RECLAIM_NOFS : 0);
+        if (page == NULL)
+            return NULL;
+        bcache[i].page = page;
+        bcache[i].data = (uint8_t *) page->kva;
+        bcache_pages ++;
+        return &bcache[i];
+    }
+    return NULL;
+}
+
+int bcache_reclaim(page_t *page) {
+    // called by swap_out(), give the frame of a clean idle block back, 1 on success
+    if (bcache_pages <= BCACHE_RESERVE)
+        return 0;
+    for (int i=0; i<NUM_BCACHE; i++) {
+        bcache_t *b = &bcache[i];
+        if (b->page != page)
+            continue;
+        if (b->pin || b->io || b->dirty)
+            return 0;
+        list_delete(&b->hash);
+        b->offset = -1;
+        b->page = NULL;
+        b->data = NULL;
+        bcache_pages --;
+        return 1;
+    }
+    return 0;
+}
+
+static bcache_t *bcache_victim(int dirty_ok) {
+    // the least recently used block which is not pinned or being read, clean ones first
+    for (int pass=0; pass<1+dirty_ok; pass++) {
+        for (list_node_t *p=bcache_lru.prev; p!=&bcache_lru; p=p->prev) {
+            bcache_t *tmp = list_entry(p, bcache_t, lru);
+            if (tmp->page != NULL && tmp->pin == 0 && !tmp->io && (pass || !tmp->dirty))
+                return tmp;
+        }
+    }
+    return NULL;
+}
+
+static void bcache_rehash(bcache_t *b, int offset) {
+    list_delete(&b->hash);
+    b->offset = offset;
+    b->dirty = 0;
+    list_insert(&bcache_hash[offset % BCACHE_HASH_SIZE], &b->hash);
+}
+
+static bcache_t *bcache_evict(int offset) {
+    // grow while there are empty slots, replace the least recently clean block after that
+    // NOTE: dirty blocks stay until the operation ends, see fs_commit_point()
+    bcache_t *b = bcache_grow(1);
+    if (b == NULL)
+        b = bcache_victim(0);
+    if (b == NULL) {
+        // prefetched blocks become evictable once read
+        blk_drain();
+        b = bcache_victim(0);
+    }
+    if (b == NULL && !bcache_committing) {
+        // one operation dirtied more than the cache holds, its transaction is split here
+        logging(LOG_WARNING, "bcache", "no clean block for 0x%x, commit in the middle of an operation\n", offset);
+        bcache_committing = 1;
+        fs_commit();
+        bcache_committing = 0;
+        b = bcache_victim(0);
+    }
+    if (b == NULL) {
+        // inodes or bitmaps of that commit have no room, or mkfs is not done, take what is dirty
+        bcache_sync();
+        b = bcache_victim(0);
+    }
+    if (b == NULL) {
+        logging(LOG_CRITICAL, "bcache", "all blocks are pinned\n");
+        assert(0);
+    }
+    bcache_rehash(b, offset);
+    return b;
+}
+
+static void bcache_wait(bcache_t *b) {
+    // a prefetch may still be queued, dispatching it also takes the following ones
+    if (b->io)
+        blk_wait(&b->req);
+}
+
+void *bcache_get(int offset) {
+    bcache_t *b = bcache_lookup(offset);
+    if (b != NULL) {
+        bcache_hit ++;
+        bcache_wait(b);
+    } else {
+        b = bcache_evict(offset);
+        read_cache(b);
+    }
+    bcache_touch(b);
+    return (void *) b->data;
+}
+
+void *bcache_new(int offset) {
+    // block will be overwritten, no need to read it from disk
+    bcache_t *b = bcache_lookup(offset);
+    if (b == NULL)
+        b = bcache_evict(offset);
+    // the read must not land on the new content later
+    bcache_wait(b);
+    bcache_touch(b);
+    memset((void *) b->data, 0, BLOCK_SIZE_BYTE);
+    return (void *) b->data;
+}
+
+void bcache_dirty(int offset) {
+    bcache_t *b = bcache_lookup(offset);
+    if (b == NULL) {
+        // NOTE: caller must get the block before writing it
+        logging(LOG_ERROR, "bcache", "block 0x%x is not cached, write discarded\n", offset);
+        return ;
+    }
+    b->dirty = 1;
+}
+
+void bcache_pin(int offset) {
+    bcache_get(offset);
+    bcache_lookup(offset)->pin ++;
+}
+
+void bcache_unpin(int offset) {
+    bcache_t *b = bcache_lookup(offset);
+    if (b == NULL || b->pin == 0) {
+        logging(LOG_ERROR, "bcache", "unpin a block 0x%x which is not pinned\n", offset);
+        return ;
+    }
+    b->pin --;
+}
+
+static void prefetch_done(blk_req_t *req) {
+    list_entry(req, bcache_t, req)->io = 0;
+}
+
+void bcache_prefetch(int offset) {
+    // start reading a block into cache without waiting for it
+    // NOTE: dirty blocks are not committed for a prefetch, it's skipped instead
+    if (bcache_lookup(offset) != NULL)
+        return ;
+    // a prefetch only takes a free frame, never reclaims one
+    bcache_t *b = bcache_grow(0);
+    if (b == NULL)
+        b = bcache_victim(0);
+    if (b == NULL)
+        return ;
+    bcache_rehash(b, offset);
+    bcache_touch(b);
+    b->io = 1;
+    b->req.dir = BLK_READ;
+    b->req.sector = FS_START + offset * BLOCK_SIZE;
+    b->req.nsect = BLOCK_SIZE;
+    b->req.kva = (uintptr_t) b->data;
+    b->req.done = prefetch_done;
+    blk_submit(&b->req);
+    bcache_prefetched ++;
+}
+
+void bcache_read_blocks(int offset, int num, uint8_t *buf) {
+    // read a run of blocks with as few bios calls as possible, bypassing the cache
+    // NOTE: cached blocks may be newer than disk, copy them from cache instead
+    for (int i=0; i<num; i+=MAX_BLOCK_RW) {
+        int n = num - i > MAX_BLOCK_RW ? MAX_BLOCK_RW : num - i;
+        blk_read((uintptr_t) bcache_bounce, n * BLOCK_SIZE, FS_START + (offset + i) * BLOCK_SIZE);
+        bcache_batch ++;
+        for (int j=0; j<n; j++) {
+            bcache_t *b = bcache_lookup(offset + i + j);
+            uint8_t *src = b != NULL && !b->io ? b->data : bcache_bounce + j * BLOCK_SIZE_BYTE;
+            memcpy(buf + (i + j) * BLOCK_SIZE_BYTE, src, BLOCK_SIZE_BYTE);
+        }
+    }
+}
+
+void bcache_write_blocks(int offset, int num, const uint8_t *buf) {
+    // write a run of blocks through to disk, cached copies are updated and become clean
+    for (int i=0; i<num; i+=MAX_BLOCK_RW) {
+        int n = num - i > MAX_BLOCK_RW ? MAX_BLOCK_RW : num - i;
+        memcpy(bcache_bounce, buf + i * BLOCK_SIZE_BYTE, n * BLOCK_SIZE_BYTE);
+        blk_write((uintptr_t) bcache_bounce, n * BLOCK_SIZE, FS_START + (offset + i) * BLOCK_SIZE);
+        bcache_batch ++;
+        for (int j=0; j<n; j++) {
+            bcache_t *b = bcache_lookup(offset + i + j);
+            if (b == NULL)
+                continue;
+            memcpy(b->data, buf + (i + j) * BLOCK_SIZE_BYTE, BLOCK_SIZE_BYTE);
+            b->dirty = 0;
+        }
+    }
+}
+
+int bcache_ndirty(void) {
+    int cnt = 0;
+    for (int i=0; i<NUM_BCACHE; i++)
+        cnt += bcache[i].offset != -1 && bcache[i].dirty;
+    return cnt;
+}
+
+static void ckpt_done(blk_req_t *req) {
+    // every block of the transaction is at home, journal is no longer needed
+    if (-- ckpt_pending == 0)
+        journal_clear();
+}
+
+void bcache_sync(void) {
+    // one transaction: log dirty blocks, then write them home (checkpoint)
+    // NOTE: only at an operation boundary, by fs_commit()
+    // NOTE: NUM_BCACHE < JOURNAL_SIZE, all dirty blocks fit in one transaction
+    static int offsets[NUM_BCACHE];
+    static uint8_t *data[NUM_BCACHE];
+    int cnt = 0;
+    for (int i=0; i<NUM_BCACHE; i++) {
+        if (bcache[i].offset != -1 && bcache[i].dirty) {
+            offsets[cnt] = bcache[i].offset;
+            data[cnt] = bcache[i].data;
+            cnt ++;
+        }
+    }
+    last_flush = get_ticks();
+    if (!cnt)
+        return ;
+    // journal is reused, last checkpoint must be finished
+    blk_drain();
+    journal_commit(cnt, offsets, data);
+
+    // checkpoint from a copy, so cached blocks can be changed or evicted meanwhile
+    // the request queue sorts and merges them, timer drains it
+    ckpt_pending = cnt;
+    for (int i=0, j=0; i<NUM_BCACHE; i++) {
+        if (bcache[i].offset == -1 || !bcache[i].dirty)
+            continue;
+        blk_req_t *req = &ckpt_req[j];
+        memcpy(ckpt_data + j * BLOCK_SIZE_BYTE, bcache[i].data, BLOCK_SIZE_BYTE);
+        req->dir = BLK_WRITE;
+        req->sector = FS_START + bcache[i].offset * BLOCK_SIZE;
+        req->nsect = BLOCK_SIZE;
+        req->kva = (uintptr_t) (ckpt_data + j * BLOCK_SIZE_BYTE);
+        req->done = ckpt_done;
+        blk_submit(req);
+        bcache[i].dirty = 0;
+        bcache_writeback ++;
+        j ++;
+    }
+    logging(LOG_DEBUG, "bcache", "sync %d dirty blocks\n", cnt);
+}
+
+void bcache_invalidate(void) {
+    // drop everything, dirty blocks are discarded
+    blk_drain();
+    for (int i=0; i<NUM_BCACHE; i++) {
+        list_delete(&bcache[i].hash);
+        bcache[i].offset = -1;
+        bcache[i].dirty = 0;
+        bcache[i].pin = 0;
+        bcache[i].io = 0;
+    }
+}
+
+void check_bcache_flush(void) {
+    // called by timer, write back dirty blocks periodically
+    // NOTE: the timer holds mm_lock, no operation is in progress
+    if (!bcache_inited || get_ticks() - last_flush < BCACHE_FLUSH_INTERVAL * time_base)
+        return ;
+    fs_commit();
+}
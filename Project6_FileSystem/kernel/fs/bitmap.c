@@ -0,0 +1,125 @@
+#include <os/blk.h>
+#include <os/fs.h>
+#include <os/kernel.h>
+#include <os/mm.h>
+#include <os/string.h>
+#include <printk.h>
+
+#define BITS_PER_WORD 64
+#define WORDS_PER_BLOCK (BLOCK_SIZE_BYTE / sizeof(uint64_t))
+#define BITS_PER_BLOCK (BLOCK_SIZE_BYTE * 8)
+
+static inline int ctz64(uint64_t x) {
+#ifdef __riscv_zbb
+    return __builtin_ctzll(x);
+#else
+    // NOTE: kernel is linked without libgcc, __builtin_ctzll() may become a call to __ctzdi2
+    int n = 0;
+    if (!(x & 0xffffffff)) { n += 32; x >>= 32; }
+    if (!(x & 0xffff))     { n += 16; x >>= 16; }
+    if (!(x & 0xff))       { n += 8;  x >>= 8;  }
+    if (!(x & 0xf))        { n += 4;  x >>= 4;  }
+    if (!(x & 0x3))        { n += 2;  x >>= 2;  }
+    if (!(x & 0x1))        { n += 1; }
+    return n;
+#endif
+}
+
+static inline int popcount64(uint64_t x) {
+    int n = 0;
+    for (; x; x &= x - 1)
+        n ++;
+    return n;
+}
+
+void init_bitmap(bitmap_t *bm, uint32_t offset, uint32_t size, int clear) {
+    // NOTE: size is fixed by layout, so the memory is allocated only once
+    if (bm->map == NULL)
+        bm->map = (uint64_t *) allocPage(size);
+    bm->offset = offset;
+    bm->size = size;
+    bm->hint = 0;
+
+    if (clear) {
+        memset((void *) bm->map, 0, size * BLOCK_SIZE_BYTE);
+    } else {
+        for (uint32_t i=0; i<size; i+=MAX_BLOCK_RW) {
+            uint32_t num = size - i > MAX_BLOCK_RW ? MAX_BLOCK_RW : size - i;
+            blk_read((uintptr_t) bm->map + i * BLOCK_SIZE_BYTE, num * BLOCK_SIZE,
+                     FS_START + (offset + i) * BLOCK_SIZE);
+        }
+    }
+
+    for (uint32_t i=0; i<size; i++) {
+        uint64_t *words = bm->map + i * WORDS_PER_BLOCK;
+        bm->free[i] = 0;
+        for (int j=0; j<WORDS_PER_BLOCK; j++)
+            bm->free[i] += BITS_PER_WORD - popcount64(words[j]);
+        // a cleared bitmap must be written to disk
+        bm->dirty[i] = clear;
+    }
+
+    logging(LOG_INFO, "bitmap", "%s bitmap at offset=0x%x, size=0x%x\n", clear ? "cleared" : "loaded", offset, size);
+}
+
+int bitmap_alloc(bitmap_t *bm) {
+    // next-fit: start from the word of last allocation
+    int words = bm->size * WORDS_PER_BLOCK;
+    for (int n=0; n<words; ) {
+        int w = (bm->hint + n) % words;
+        int blk = w / WORDS_PER_BLOCK;
+        if (bm->free[blk] == 0) {
+            // skip the whole bitmap block
+            n += WORDS_PER_BLOCK - w % WORDS_PER_BLOCK;
+            continue;
+        }
+        if (~bm->map[w]) {
+            int bit = ctz64(~bm->map[w]);
+            bm->map[w] |= 1lu << bit;
+            bm->free[blk] --;
+            bm->dirty[blk] = 1;
+            bm->hint = w;
+            return w * BITS_PER_WORD + bit;
+        }
+        n ++;
+    }
+    return -1;
+}
+
+int bitmap_alloc_at(bitmap_t *bm, int idx) {
+    // alloc the given bit if it's free, used to keep a file contiguous
+    int w = idx / BITS_PER_WORD;
+    int bit = idx % BITS_PER_WORD;
+    int blk = idx / BITS_PER_BLOCK;
+    if (idx < 0 || blk >= bm->size || (bm->map[w] & (1lu << bit)))
+        return -1;
+    bm->map[w] |= 1lu << bit;
+    bm->free[blk] --;
+    bm->dirty[blk] = 1;
+    return idx;
+}
+
+int bitmap_free(bitmap_t *bm, int idx) {
+    int w = idx / BITS_PER_WORD;
+    int bit = idx % BITS_PER_WORD;
+    int blk = idx / BITS_PER_BLOCK;
+    if (idx < 0 || blk >= bm->size || !(bm->map[w] & (1lu << bit))) {
+        logging(LOG_WARNING, "bitmap", "free an unused bit %d\n", idx);
+        return -1;
+    }
+    bm->map[w] &= ~(1lu << bit);
+    bm->free[blk] ++;
+    bm->dirty[blk] = 1;
+    return 0;
+}
+
+void bitmap_sync(bitmap_t *bm) {
+    // write changed bitmap blocks to bcache
+    for (uint32_t i=0; i<bm->size; i++) {
+        if (!bm->dirty[i])
+            continue;
+        memcpy((uint8_t *) bcache_new(bm->offset + i), (uint8_t *) (bm->map + i * WORDS_PER_BLOCK), BLOCK_SIZE_BYTE);
+        bcache_dirty(bm->offset + i);
+        bm->dirty[i] = 0;
+    }
+}
@@ -0,0 +1,128 @@
+#include <os/fs.h>
+#include <os/kernel.h>
+#include <os/list.h>
+#include <os/string.h>
+#include <printk.h>
+
+#define DCACHE_HASH_SIZE 64
+
+typedef struct dcache {
+    // (pino, name) -> ino, ino == -1 means the name does not exist
+    int pino;
+    int ino;
+    uint32_t hash;
+    char name[DCACHE_NAME_LEN];
+    list_node_t lru;
+    list_node_t hash_node;
+} dcache_t;
+
+static dcache_t dcache[NUM_DCACHE];
+
+// most recently used at head, victim taken from tail
+static LIST_HEAD(dcache_lru);
+static list_head dcache_hash[DCACHE_HASH_SIZE];
+
+// statistics, shown in statfs
+int dcache_hit = 0;
+int dcache_miss = 0;
+
+static uint32_t name_hash(int pino, const char *name, int len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u ^ (uint32_t) pino;
+    for (int i=0; i<len; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void init_dcache(void) {
+    for (int i=0; i<DCACHE_HASH_SIZE; i++)
+        list_init(&dcache_hash[i]);
+    for (int i=0; i<NUM_DCACHE; i++) {
+        dcache[i].pino = -1;
+        list_init(&dcache[i].hash_node);
+        list_insert(dcache_lru.prev, &dcache[i].lru);
+    }
+}
+
+static int name_equal(const char *cached, const char *name, int len) {
+    // NOTE: name is a path component, not null-terminated
+    for (int i=0; i<len; i++)
+        if (cached[i] != name[i])
+            return 0;
+    return cached[len] == '\0';
+}
+
+static dcache_t *dcache_find(int pino, const char *name, int len, uint32_t hash) {
+    list_head *head = &dcache_hash[hash % DCACHE_HASH_SIZE];
+    for (list_node_t *p=head->next; p!=head; p=p->next) {
+        dcache_t *d = list_entry(p, dcache_t, hash_node);
+        if (d->hash == hash && d->pino == pino && name_equal(d->name, name, len))
+            return d;
+    }
+    return NULL;
+}
+
+static void dcache_drop(dcache_t *d) {
+    list_delete(&d->hash_node);
+    d->pino = -1;
+    // reuse it first
+    list_delete(&d->lru);
+    list_insert(dcache_lru.prev, &d->lru);
+}
+
+int dcache_lookup(int pino, const char *name, int len, int *ino) {
+    // return 1 and set *ino if (pino, name) is cached, negative entries included
+    dcache_t *d = dcache_find(pino, name, len, name_hash(pino, name, len));
+    if (d == NULL) {
+        dcache_miss ++;
+        return 0;
+    }
+    dcache_hit ++;
+    list_delete(&d->lru);
+    list_insert(&dcache_lru, &d->lru);
+    *ino = d->ino;
+    return 1;
+}
+
+void dcache_insert(int pino, const char *name, int len, int ino) {
+    if (len >= DCACHE_NAME_LEN)
+        return ;
+    uint32_t hash = name_hash(pino, name, len);
+    dcache_t *d = dcache_find(pino, name, len, hash);
+    if (d == NULL) {
+        // take the least recently used one
+        d = list_entry(dcache_lru.prev, dcache_t, lru);
+        if (d->pino != -1)
+            list_delete(&d->hash_node);
+        d->pino = pino;
+        d->hash = hash;
+        memcpy((uint8_t *) d->name, (uint8_t *) name, len);
+        d->name[len] = '\0';
+        list_insert(&dcache_hash[hash % DCACHE_HASH_SIZE], &d->hash_node);
+    }
+    d->ino = ino;
+    list_delete(&d->lru);
+    list_insert(&dcache_lru, &d->lru);
+}
+
+void dcache_remove(int pino, const char *name) {
+    int len = strlen(name);
+    dcache_t *d = dcache_find(pino, name, len, name_hash(pino, name, len));
+    if (d != NULL)
+        dcache_drop(d);
+}
+
+void dcache_remove_dir(int ino) {
+    // drop entries in a removed directory and entries pointing to it
+    for (int i=0; i<NUM_DCACHE; i++)
+        if (dcache[i].pino != -1 && (dcache[i].pino == ino || dcache[i].ino == ino))
+            dcache_drop(&dcache[i]);
+}
+
+void dcache_invalidate(void) {
+    for (int i=0; i<NUM_DCACHE; i++)
+        if (dcache[i].pino != -1)
+            dcache_drop(&dcache[i]);
+}
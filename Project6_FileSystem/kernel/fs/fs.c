@@ -1,6 +1,8 @@
+#include <os/blk.h>
 #include <os/kernel.h>
 #include <os/loader.h>
 #include <os/mm.h>
+#include <os/pthread.h>
 #include <os/sched.h>
 #include <os/smp.h>
 #include <os/string.h>
@@ -13,10 +15,9 @@
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
 static superblock_t superblock;
-static fdesc_t fdesc_array[NUM_FDESCS];
-
-// buf[0] for data, buf[1] for inode
-static uint8_t buf[2][BLOCK_SIZE_BYTE];
+// system-wide open-file table, grows by FILE_TABLE_CHUNK and never shrinks
+static LIST_HEAD(free_files);
+static int file_table_size = 0;
 
 // this should always point to a DIR inode
 static int current_ino;
@@ -25,50 +26,42 @@ static int is_fs_avaliable(void) {
     return superblock.magic0 == SUPERBLOCK_MAGIC && superblock.magic1 == SUPERBLOCK_MAGIC;
 }
 
-static int write_buf(uint32_t offset, int buf_id) {
-    return bios_sdwrite(kva2pa((uint64_t) buf[buf_id]), BLOCK_SIZE, FS_START + offset * BLOCK_SIZE);
-}
+static bitmap_t inode_map;
+static bitmap_t block_map;
 
-static int read_buf(uint32_t offset, int buf_id) {
-    return bios_sdread(kva2pa((uint64_t) buf[buf_id]), BLOCK_SIZE, FS_START + offset * BLOCK_SIZE);
+static void write_superblock(void) {
+    // counters in superblock and bitmaps must reach disk together
+    bitmap_sync(&inode_map);
+    bitmap_sync(&block_map);
+    memcpy((uint8_t *) bcache_new(0), (uint8_t *) &superblock, sizeof(superblock_t));
+    bcache_dirty(0);
 }
 
-static int write_superblock(void) {
-    return bios_sdwrite(kva2pa((uint64_t) &superblock), BLOCK_SIZE, FS_START);
+// blocks promised to delayed blocks, only their flush may take them, see delalloc_get()
+static int block_reserved = 0;
+static int delalloc_flushing = 0;
+
+static int block_available(int num) {
+    int reserved = delalloc_flushing ? 0 : block_reserved;
+    return superblock.block_num + reserved + num <= MAX_BLOCK_NUM;
 }
 
 static int _alloc_bitmap(int tp) {
-    int map_num = tp == 0 ? superblock.inode_map_size : superblock.block_map_size;
-    int map_base = tp == 0 ? superblock.inode_map_offset : superblock.block_map_offset;
-    for (int i=0; i<map_num; i++) {              // which block
-        read_buf(map_base + i, 0);
-        for (int j=0; j<BLOCK_SIZE_BYTE; j++) {  // which byte
-            if (buf[0][j] != 0xff) {
-                for (int k=0; k<8; k++) {        // which bit
-                    if (!(buf[0][j] & (1 << k))) {  // not used
-                        buf[0][j] |= (1 << k);
-                        write_buf(map_base + i, 0);
-                        if (tp == 0)
-                            superblock.inode_num ++;
-                        else
-                            superblock.block_num ++;
-                        return (i * BLOCK_SIZE_BYTE + j) * 8 + k;
-                    }
-                }
-            }
-        }
-    }
-    return -1;
+    if (tp == 1 && !block_available(1))
+        return -1;
+    int idx = bitmap_alloc(tp == 0 ? &inode_map : &block_map);
+    if (idx == -1)
+        return -1;
+    if (tp == 0)
+        superblock.inode_num ++;
+    else
+        superblock.block_num ++;
+    return idx;
 }
 
 static int _free_bitmap(int tp, int idx) {
-    int map_base = tp == 0 ? superblock.inode_map_offset : superblock.block_map_offset;
-    int block = idx / BLOCK_SIZE_BYTE;
-    int byte = (idx % BLOCK_SIZE_BYTE) / 8;
-    int bit = idx % 8;
-    read_buf(map_base + block, 0);
-    buf[0][byte] &= ~(1 << bit);
-    write_buf(map_base + block, 0);
+    if (bitmap_free(tp == 0 ? &inode_map : &block_map, idx) == -1)
+        return -1;
     if (tp == 0)
         superblock.inode_num --;
     else
@@ -81,24 +74,247 @@ static int _free_bitmap(int tp, int idx) {
 #define free_inode(idx) _free_bitmap(0, idx);
 #define free_block(idx) _free_bitmap(1, idx);
 
+static int alloc_block_at(int idx) {
+    if (!block_available(1) || bitmap_alloc_at(&block_map, idx) == -1)
+        return -1;
+    superblock.block_num ++;
+    return idx;
+}
+
+static int alloc_block_near(int goal) {
+    // try goal first to keep a file physically contiguous
+    if (goal != -1 && alloc_block_at(goal) != -1)
+        return goal;
+    return alloc_block();
+}
 
+
+/* NOTE: pointers returned by get_xxx() stay valid until evicted from icache / bcache,
+ * iget() / pin it if it's used across a loop that touches many inodes / blocks
+ */
 static inode_t *get_inode(int ino) {
-    int block = superblock.inode_offset + ino / BLOCK_SIZE_BYTE;
-    int offset = ino % BLOCK_SIZE_BYTE;
-    read_buf(block, 1);
-    return ((inode_t *) &buf[1]) + offset;
+    return icache_get(ino);
 }
 static void write_inode(int ino) {
-    int block = superblock.inode_offset + ino / BLOCK_SIZE_BYTE;
-    write_buf(block, 1);
+    // written back lazily by icache_sync()
+    icache_dirty(ino);
 }
 
 static void *get_block(int block) {
-    read_buf(superblock.data_offset + block, 0);
-    return (void *) buf[0];
+    return bcache_get(superblock.data_offset + block);
+}
+static void *get_empty_block(int block) {
+    // get a zeroed block without reading it from disk
+    return bcache_new(superblock.data_offset + block);
 }
 static void write_block(int block) {
-    write_buf(superblock.data_offset + block, 0);
+    bcache_dirty(superblock.data_offset + block);
+}
+static void pin_block(int block) {
+    bcache_pin(superblock.data_offset + block);
+}
+static void unpin_block(int block) {
+    bcache_unpin(superblock.data_offset + block);
+}
+
+// defined with file block mapping below
+static int find_block(inode_t *inode, int block_no, int new_block);
+static void free_inode_blocks(inode_t *inode);
+static void init_delalloc(void);
+
+/* directories: block 0 is a hash index (dindex_t), the others are leaves of dentries
+ * a name always lives in the leaf whose hash range covers its hash
+ */
+static uint32_t dentry_hash(const char *name, int len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i=0; i<len; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int dir_block(int dino, int block_no) {
+    return find_block(get_inode(dino), block_no, -1);
+}
+
+static int dir_find_leaf(int dino, uint32_t hash, int *pos) {
+    // binary search the last index entry whose hash <= hash
+    dindex_t *index = (dindex_t *) get_block(dir_block(dino, 0));
+    int l = 0, r = index->num;
+    while (l < r) {
+        int mid = (l + r) / 2;
+        if (index->entries[mid].hash <= hash)
+            l = mid + 1;
+        else
+            r = mid;
+    }
+    if (pos != NULL)
+        *pos = l - 1;
+    return index->entries[l-1].block_no;
+}
+
+static int dir_lookup(int dino, char *name, int len) {
+    // search dino for name[0:len], return -2 if dino is not a directory
+    inode_t *inode = get_inode(dino);
+    if (inode->type != INODE_DIR) {
+        logging(LOG_ERROR, "fs", "path_lookup: ino=%d is not a directory\n", dino);
+        return -2;
+    }
+    int leaf = dir_block(dino, dir_find_leaf(dino, dentry_hash(name, len), NULL));
+    dentry_t *dentry = (dentry_t *) get_block(leaf);
+    for (int j=0; j<DENTRY_PER_BLOCK; j++) {
+        if (dentry[j].valid && strncmp(dentry[j].name, name, len-1) == 0 && strlen(dentry[j].name) == len) {
+            logging(LOG_VERBOSE, "fs", "found entry=%s path=%s len=%d, ino=%d\n",
+                    dentry[j].name, name, len, dentry[j].ino);
+            return dentry[j].ino;
+        }
+    }
+    return -1;
+}
+
+static int dir_split(int dino, int pos) {
+    // split the full leaf of index entry pos into a new leaf at the end of dino
+    int index_block = dir_block(dino, 0);
+    dindex_t *index = (dindex_t *) get_block(index_block);
+    if (index->num == DINDEX_ENTRY_NUM) {
+        logging(LOG_ERROR, "fs", "... directory index of ino=%d is full\n", dino);
+        return -1;
+    }
+    int leaf = dir_block(dino, index->entries[pos].block_no);
+
+    // split at the hash nearest to the median
+    uint32_t hashes[DENTRY_PER_BLOCK];
+    dentry_t *dentry = (dentry_t *) get_block(leaf);
+    for (int i=0; i<DENTRY_PER_BLOCK; i++) {
+        uint32_t h = dentry_hash(dentry[i].name, strlen(dentry[i].name));
+        int j = i;
+        for (; j>0 && hashes[j-1] > h; j--)
+            hashes[j] = hashes[j-1];
+        hashes[j] = h;
+    }
+    int mid = DENTRY_PER_BLOCK / 2;
+    while (mid < DENTRY_PER_BLOCK && hashes[mid] == hashes[mid-1])
+        mid ++;
+    if (mid == DENTRY_PER_BLOCK) {
+        mid = DENTRY_PER_BLOCK / 2;
+        while (mid > 0 && hashes[mid] == hashes[mid-1])
+            mid --;
+    }
+    if (mid == 0) {
+        logging(LOG_ERROR, "fs", "... too many hash collisions in ino=%d\n", dino);
+        return -1;
+    }
+    uint32_t split = hashes[mid];
+
+    // append a new leaf
+    int new_leaf = alloc_block();
+    if (new_leaf == -1)
+        return -1;
+    inode_t *inode = get_inode(dino);
+    int new_no = inode->size / BLOCK_SIZE_BYTE;
+    iget(dino);
+    if (find_block(inode, new_no, new_leaf) == -1) {
+        iput(dino);
+        free_block(new_leaf);
+        return -1;
+    }
+    inode->size += BLOCK_SIZE_BYTE;
+    write_inode(dino);
+    iput(dino);
+
+    // move names with hash >= split
+    pin_block(leaf);
+    dentry = (dentry_t *) get_block(leaf);
+    dentry_t *new_dentry = (dentry_t *) get_empty_block(new_leaf);
+    int k = 0;
+    for (int i=0; i<DENTRY_PER_BLOCK; i++) {
+        if (dentry_hash(dentry[i].name, strlen(dentry[i].name)) >= split) {
+            memcpy((uint8_t *) &new_dentry[k++], (uint8_t *) &dentry[i], sizeof(dentry_t));
+            dentry[i].valid = 0;
+        }
+    }
+    write_block(new_leaf);
+    write_block(leaf);
+    unpin_block(leaf);
+
+    index = (dindex_t *) get_block(index_block);
+    for (int i=index->num; i>pos+1; i--)
+        index->entries[i] = index->entries[i-1];
+    index->entries[pos+1].hash = split;
+    index->entries[pos+1].block_no = new_no;
+    index->num ++;
+    write_block(index_block);
+    logging(LOG_VERBOSE, "fs", "... split leaf of ino=%d at hash 0x%x, %d entries moved to block %d\n", dino, split, k, new_no);
+    return 0;
+}
+
+static int dir_add(int dino, char *name, int ino) {
+    int pos;
+    int leaf = dir_block(dino, dir_find_leaf(dino, dentry_hash(name, strlen(name)), &pos));
+    dentry_t *dentry = (dentry_t *) get_block(leaf);
+    for (int j=0; j<DENTRY_PER_BLOCK; j++) {
+        if (!dentry[j].valid) {
+            logging(LOG_VERBOSE, "fs", "... found empty entry at %d of block %d\n", j, leaf);
+            dentry[j].valid = 1;
+            dentry[j].ino = ino;
+            strcpy(dentry[j].name, name);
+            write_block(leaf);
+            return 0;
+        }
+    }
+    // leaf is full, both halves have room after split
+    if (dir_split(dino, pos) == -1)
+        return -1;
+    return dir_add(dino, name, ino);
+}
+
+static int dir_remove(int dino, char *name, int ino) {
+    int leaf = dir_block(dino, dir_find_leaf(dino, dentry_hash(name, strlen(name)), NULL));
+    dentry_t *dentry = (dentry_t *) get_block(leaf);
+    for (int j=0; j<DENTRY_PER_BLOCK; j++) {
+        if (dentry[j].valid && dentry[j].ino == ino && strcmp(dentry[j].name, name) == 0) {
+            logging(LOG_DEBUG, "fs", "... found entry at %d of block %d\n", j, leaf);
+            dentry[j].valid = 0;
+            write_block(leaf);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int dir_init(int ino, int pino) {
+    // index block and the first leaf holding "." and "..", -1 if there is no space
+    int index_block = alloc_block();
+    if (index_block == -1)
+        return -1;
+    int leaf = alloc_block();
+    if (leaf == -1) {
+        free_block(index_block);
+        return -1;
+    }
+    inode_t *inode = get_inode(ino);
+    find_block(inode, 0, index_block);
+    find_block(inode, 1, leaf);
+    inode->size = 2 * BLOCK_SIZE_BYTE;
+    write_inode(ino);
+
+    dindex_t *index = (dindex_t *) get_empty_block(index_block);
+    index->num = 1;
+    index->entries[0].hash = 0;
+    index->entries[0].block_no = 1;
+    write_block(index_block);
+
+    dentry_t *dentry = (dentry_t *) get_empty_block(leaf);
+    dentry[0].ino = ino;
+    dentry[0].valid = 1;
+    strcpy(dentry[0].name, ".");
+    dentry[1].ino = pino;
+    dentry[1].valid = 1;
+    strcpy(dentry[1].name, "..");
+    write_block(leaf);
+    return 0;
 }
 
 static int path_lookup(char *path, char **name, int *pino) {
@@ -129,26 +345,19 @@ static int path_lookup(char *path, char **name, int *pino) {
         if (*p == '/' || *p == '\0') {
             *pino = ino;
             int found = 0;
-            // search ino's direct blocks
-            for (int i=0; i<DIRECT_BLOCK_NUM && !found; i++) {
-                inode_t *inode = get_inode(ino);
-                if (inode->type != INODE_DIR) {
-                    logging(LOG_ERROR, "fs", "path_lookup: ino=%d is not a directory\n", ino);
+            int dino = ino;
+            if (dcache_lookup(dino, pp, len, &ino)) {
+                // NOTE: only entries of directories are cached
+                logging(LOG_VERBOSE, "fs", "dcache hit path=%s len=%d, ino=%d\n", pp, len, ino);
+                found = ino != -1;
+            } else {
+                ino = dir_lookup(dino, pp, len);
+                if (ino == -2) {
                     *pino = -1;
                     return -1;
                 }
-                if (inode->direct_blocks[i] == -1)
-                    break;
-                dentry_t *dentry = (dentry_t *) get_block(inode->direct_blocks[i]);
-                for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(dentry_t); j++) {
-                    if (dentry[j].valid && strncmp(dentry[j].name, pp, len-1) == 0 && strlen(dentry[j].name) == len) {
-                        logging(LOG_VERBOSE, "fs", "found entry=%s path=%s len=%d, ino=%d\n",
-                                dentry[j].name, pp, len, dentry[j].ino);
-                        ino = dentry[j].ino;
-                        found = 1;
-                        break;
-                    }
-                }
+                found = ino != -1;
+                dcache_insert(dino, pp, len, ino);
             }
             if (!found) {
                 ino = -1;
@@ -170,72 +379,70 @@ static int path_lookup(char *path, char **name, int *pino) {
     return ino;
 }
 
-static void _mkdentry(int ino, int pino, int tp) {
-    int dir_block = -1;
-    if (tp == INODE_DIR) {
-        dir_block = alloc_block();
-        logging(LOG_VERBOSE, "fs", "mkdir for ino=0x%x, pino=0x%x, block=0x%x\n", ino, pino, dir_block);
-    } else {
-        logging(LOG_VERBOSE, "fs", "mkfile for ino=0x%x, pino=0x%x\n", ino, pino);
-    }
-    // pino's link + 1
-    inode_t *inode = get_inode(pino);
-    inode->link ++;
-    write_inode(pino);
-
+static int _mkdentry(int ino, int pino, int tp) {
+    // 0 on success, -1 if a directory gets no block, pino is untouched then
+    logging(LOG_VERBOSE, "fs", "%s for ino=0x%x, pino=0x%x\n", tp == INODE_DIR ? "mkdir" : "mkfile", ino, pino);
     // set ino
-    inode = get_inode(ino);
+    inode_t *inode = get_inode(ino);
     inode->type = tp;
     inode->link = tp == INODE_DIR ? 2 : 1;  // dir always has at least 2 link(self->self, parent->self), and file has 1 (parent->self)
-    inode->size = tp == INODE_DIR ? BLOCK_SIZE_BYTE : 0;  // dir always has at least 1 block(. and ..)
-    inode->direct_blocks[0] = dir_block;
-    for (int i=1; i<DIRECT_BLOCK_NUM; i++)
-        inode->direct_blocks[i] = -1;
-    for (int i=0; i<INDIRECT_BLOCK_L1_NUM; i++)
-        inode->indirect_blocks_l1[i] = -1;
-    for (int i=0; i<INDIRECT_BLOCK_L2_NUM; i++)
-        inode->indirect_blocks_l2[i] = -1;
-    for (int i=0; i<INDIRECT_BLOCK_L3_NUM; i++)
-        inode->indirect_blocks_l3[i] = -1;
+    inode->size = 0;
+    if (tp == INODE_FILE && superblock.mapping == FS_MAP_EXTENT) {
+        inode->extent_num = 0;
+        inode->extent_block = -1;
+    } else {
+        for (int i=0; i<DIRECT_BLOCK_NUM; i++)
+            inode->direct_blocks[i] = -1;
+        for (int i=0; i<INDIRECT_BLOCK_L1_NUM; i++)
+            inode->indirect_blocks_l1[i] = -1;
+        for (int i=0; i<INDIRECT_BLOCK_L2_NUM; i++)
+            inode->indirect_blocks_l2[i] = -1;
+        for (int i=0; i<INDIRECT_BLOCK_L3_NUM; i++)
+            inode->indirect_blocks_l3[i] = -1;
+    }
     write_inode(ino);
 
-    if (tp == INODE_DIR) {
-        // set default dentries
-        dentry_t *dentry = (dentry_t *) get_block(dir_block);
-        dentry[0].ino = ino;
-        dentry[0].valid = 1;
-        strcpy(dentry[0].name, ".");
-        dentry[1].ino = pino;
-        dentry[1].valid = 1;
-        strcpy(dentry[1].name, "..");
-        for (int i=2; i<BLOCK_SIZE_BYTE/sizeof(dentry_t); i++)
-            dentry[i].valid = 0;
-        write_block(dir_block);
+    // dir always has at least an index block and a leaf (. and ..)
+    if (tp == INODE_DIR && dir_init(ino, pino) == -1) {
+        logging(LOG_ERROR, "fs", "no free block for directory ino=%d\n", ino);
+        return -1;
     }
+
+    // pino's link + 1
+    inode = get_inode(pino);
+    inode->link ++;
+    write_inode(pino);
+    return 0;
 }
 
 void init_fs(void) {
     // NOTE: this should be called only by kernel on init
     // try to load fs from disk
+    init_bcache();
+    init_dcache();
+    init_delalloc();
+    // finish the last committed transaction before anything is read
+    init_journal();
     logging(LOG_INFO, "init", "Try to load fs from disk\n");
-    read_buf(0, 0);
-    memcpy((uint8_t *) &superblock, (uint8_t *) buf[0], sizeof(superblock_t));
+    memcpy((uint8_t *) &superblock, (uint8_t *) bcache_get(0), sizeof(superblock_t));
 
     // not on disk / corrupted
     if (!is_fs_avaliable()) {
         logging(LOG_WARNING, "init", "No fs found on disk, run mkfs\n");
-        do_mkfs();
+        do_mkfs(0);
+    } else {
+        init_icache(superblock.inode_offset);
+        init_bitmap(&inode_map, superblock.inode_map_offset, superblock.inode_map_size, 0);
+        init_bitmap(&block_map, superblock.block_map_offset, superblock.block_map_size, 0);
     }
 
-    // init fdesc_array
-    for (int i=0; i<NUM_FDESCS; i++)
-        fdesc_array[i].ino = -1;
-
     // if fs loaded, root dir's ino must bt 0
     current_ino = 0;
 }
 
-int do_mkfs(void) {
+#define MKFS_OPTIONS_E 0x1
+
+int do_mkfs(int option) {
     pcb_t *self = current_running[get_current_cpu_id()];
     logging(LOG_INFO, "fs", "%d.%s.%d run mkfs\n", self->pid, self->name, self->tid);
 
@@ -248,7 +455,11 @@ int do_mkfs(void) {
     superblock.fs_start = FS_START;
     logging(LOG_MAN, "fs", "... start sector: 0x%x\n", FS_START);
 
-    superblock.inode_map_offset = 1;
+    superblock.journal_offset = JOURNAL_OFFSET;
+    superblock.journal_size = JOURNAL_SIZE;
+    logging(LOG_MAN, "fs", "... journal: offset=0x%x, size=0x%x\n", superblock.journal_offset, superblock.journal_size);
+
+    superblock.inode_map_offset = superblock.journal_offset + superblock.journal_size;
     superblock.inode_map_size = MAX_INODE_MAP_SIZE;
     superblock.inode_num = 0;
     logging(LOG_MAN, "fs", "... inode map: offset=0x%x, size=0x%x\n", superblock.inode_map_size, superblock.inode_map_size);
@@ -264,27 +475,35 @@ int do_mkfs(void) {
     logging(LOG_MAN, "fs", "... inode: offset=0x%x, size=0x%x (%dB)\n", superblock.inode_offset, inode_size, real_inode_size);
     superblock.data_offset = superblock.inode_offset + inode_size;
     logging(LOG_MAN, "fs", "... data: offset=0x%x\n", superblock.data_offset);
+    superblock.mapping = (option & MKFS_OPTIONS_E) ? FS_MAP_EXTENT : FS_MAP_INDIRECT;
+    logging(LOG_MAN, "fs", "... mapping: %s\n", superblock.mapping == FS_MAP_EXTENT ? "extent" : "indirect");
     logging(LOG_MAN, "fs", "inode entry size: %dB\n", sizeof(inode_t));
     logging(LOG_MAN, "fs", "directory entry size: %dB\n", sizeof(dentry_t));
 
-    // clear inode map, block map
-    memset((void *) buf[0], 0, BLOCK_SIZE_BYTE);
+    // cached blocks belong to the old fs, so does the journal
+    bcache_invalidate();
+    journal_clear();
+    dcache_invalidate();
+    init_delalloc();
+    init_icache(superblock.inode_offset);
 
+    // clear inode map, block map
     logging(LOG_MAN, "fs", "Setting inode map\n");
-    for (uint32_t i=0; i<superblock.inode_map_size; i++)
-        write_buf(superblock.inode_map_offset + i, 0);
+    init_bitmap(&inode_map, superblock.inode_map_offset, superblock.inode_map_size, 1);
 
     logging(LOG_MAN, "fs", "Setting block map\n");
-    for (uint32_t i=0; i<superblock.block_map_size; i++)
-        write_buf(superblock.block_map_offset + i, 0);
+    init_bitmap(&block_map, superblock.block_map_offset, superblock.block_map_size, 1);
 
     // create root dir
     logging(LOG_MAN, "fs", "Creating root directory\n");
     current_ino = alloc_inode();
-    _mkdentry(current_ino, current_ino, INODE_DIR);
+    if (_mkdentry(current_ino, current_ino, INODE_DIR) == -1)
+        return -1;
 
     // write superblock
+    icache_sync();
     write_superblock();
+    bcache_sync();
 
     return 0;  // do_mkfs succeeds
 }
@@ -297,16 +516,24 @@ int do_statfs(void) {
 
     printk("magic       : 0x%x\n", superblock.magic0);
     printk("start sector: 0x%x\n", superblock.fs_start);
+    printk("journal     : offset=0x%x, size=0x%x\n", superblock.journal_offset, superblock.journal_size);
     printk("inode map   : offset=0x%x, size=0x%x\n", superblock.inode_map_offset, superblock.inode_map_size);
     printk("block map   : offset=0x%x, size=0x%x\n", superblock.block_map_offset, superblock.block_map_size);
     uint32_t real_inode_size = MAX_INODE_NUM * sizeof(inode_t);
     uint32_t inode_size = ROUND(real_inode_size, BLOCK_SIZE_BYTE) / BLOCK_SIZE_BYTE;
     printk("inode       : offset=0x%x, size=0x%x (%dB)\n", superblock.inode_offset, inode_size, real_inode_size);
     printk("data        : offset=0x%x\n", superblock.data_offset);
+    printk("mapping     : %s\n", superblock.mapping == FS_MAP_EXTENT ? "extent" : "indirect");
     printk("used inode %d / %d\n", superblock.inode_num, MAX_INODE_NUM);
     printk("used block %d / %d\n", superblock.block_num, MAX_BLOCK_NUM);
     printk("inode entry size: %dB\n", sizeof(inode_t));
     printk("directory entry size: %dB\n", sizeof(dentry_t));
+    printk("bcache: %d pages, hit %d, miss %d, write back %d, batched %d, prefetched %d\n",
+           bcache_pages, bcache_hit, bcache_miss, bcache_writeback, bcache_batch, bcache_prefetched);
+    printk("icache: hit %d, miss %d\n", icache_hit, icache_miss);
+    printk("journal: %d commits\n", journal_commits);
+    printk("blk: %d dispatched, %d merged\n", blk_dispatch, blk_merged);
+    printk("dcache: hit %d, miss %d\n", dcache_hit, dcache_miss);
 
     return 0;  // do_statfs succeeds
 }
@@ -375,46 +602,25 @@ int do_mkdentry(char *path, int tp) {
         return -1;
     }
 
-    // find a invalid dentry and mkdir
-    int success = 0;
+    // add dentry to parent dir
     logging(LOG_INFO, "fs", "... %s \"%s\" in inode=%d\n", funcname, name, pino);
-    for (int i=0; i<DIRECT_BLOCK_NUM && !success; i++) {
-        inode_t *inode = get_inode(pino);
-        dentry_t *dentry;
-        if (inode->direct_blocks[i] == -1) {
-            // all blocks are full, alloc a new block
-            inode->direct_blocks[i] = alloc_block();
-            logging(LOG_VERBOSE, "fs", "... all direct blocks full, alloc a new one\n");
-            inode->size += 4096;
-            write_inode(pino);
-            // clear the new block
-            memset((void *) buf[0], 0, BLOCK_SIZE_BYTE);
-            dentry = (dentry_t *) buf[0];
-        } else {
-            dentry = (dentry_t *) get_block(inode->direct_blocks[i]);
-        }
-        logging(LOG_VERBOSE, "fs", "... searching direct_blocks[%d] at %d\n", i, inode->direct_blocks[i]);
-        for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(dentry_t); j++) {
-            if (!dentry[j].valid) {
-                logging(LOG_VERBOSE, "fs", "... found empty entry at %d\n", j);
-                dentry[j].valid = 1;
-                dentry[j].ino = ino;
-                strcpy(dentry[j].name, name);
-                write_block(inode->direct_blocks[i]);
-                success = 1;
-                break;
-            }
-        }
+    int success = dir_add(pino, name, ino) == 0;
+    if (success && _mkdentry(ino, pino, tp) == -1) {
+        // no block for the new directory, take the dentry back
+        dir_remove(pino, name, ino);
+        success = 0;
     }
     if (success) {
-        // make dentry
-        _mkdentry(ino, pino, tp);
+        dcache_remove(pino, name);
 
         // write superblock
         write_superblock();
         return 0;  // do_mkdir succeeds
     } else {
-        logging(LOG_ERROR, "fs", "mkdir failed\n");
+        dcache_remove(pino, name);
+        free_inode(ino);
+        write_superblock();
+        logging(LOG_ERROR, "fs", "%s failed\n", funcname);
         return -1;
     }
 }
@@ -470,41 +676,28 @@ int do_rmdir(char *path) {
         return -1;
     }
 
-    // find ino's dentry in dino
-    int success = 0;
+    // remove ino's dentry in pino
     logging(LOG_INFO, "fs", "... rmdir \"%s\" in inode=%d\n", name, pino);
-    inode = get_inode(pino);
-    for (int i=0; i<DIRECT_BLOCK_NUM && !success; i++) {
-        if (inode->direct_blocks[i] == -1)
-            break;
-        dentry_t *dentry = (dentry_t *) get_block(inode->direct_blocks[i]);
-        logging(LOG_DEBUG, "fs", "... searching direct_blocks[%d] at %d\n", i, inode->direct_blocks[i]);
-        for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(dentry_t); j++) {
-            if (dentry[j].valid && dentry[j].ino == ino) {
-                logging(LOG_DEBUG, "fs", "... found entry at %d\n", j);
-                dentry[j].valid = 0;
-                write_block(inode->direct_blocks[i]);
-                success = 1;
-                break;
-            }
-        }
-    }
+    int success = dir_remove(pino, name, ino) == 0;
 
     if (success) {
+        dcache_remove(pino, name);
+
         // pino's link --
+        inode = get_inode(pino);
         inode->link --;
         write_inode(pino);
 
         // remove ino's blocks
         inode = get_inode(ino);
-        for (int i=0; i<DIRECT_BLOCK_NUM; i++) {
-            if (inode->direct_blocks[i] == -1)
-                break;
-            free_block(inode->direct_blocks[i]);
-        }
+        iget(ino);
+        free_inode_blocks(inode);
+        iput(ino);
 
         free_inode(ino);
 
+        dcache_remove_dir(ino);
+
         // current is removed, cd to parent
         if (ino == current_ino) {
             logging(LOG_DEBUG, "fs", "... current is removed, cd to parent\n");
@@ -561,13 +754,14 @@ int do_ls(char *path, int option) {
         printk("ino | type | lnk |   size   | name\n");
     }
 
-    for (int i=0; i<DIRECT_BLOCK_NUM; i++) {
-        inode_t *inode = get_inode(ino);
-        if (inode->direct_blocks[i] == -1)
-            break;
-        logging(LOG_DEBUG, "fs", "... direct_block[%d]: 0x%x\n", i, inode->direct_blocks[i]);
-        dentry_t *dentry = (dentry_t *) get_block(inode->direct_blocks[i]);
-        for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(dentry_t); j++) {
+    // leaves are block 1 to the end, in hash order
+    int leaf_num = inode->size / BLOCK_SIZE_BYTE;
+    for (int i=1; i<leaf_num; i++) {
+        int leaf = dir_block(ino, i);
+        logging(LOG_DEBUG, "fs", "... leaf[%d]: 0x%x\n", i, leaf);
+        pin_block(leaf);
+        dentry_t *dentry = (dentry_t *) get_block(leaf);
+        for (int j=0; j<DENTRY_PER_BLOCK; j++) {
             if (dentry[j].valid) {
                 if (!all && dentry[j].name[0] == '.')
                     continue;
@@ -582,6 +776,7 @@ int do_ls(char *path, int option) {
                 }
             }
         }
+        unpin_block(leaf);
     }
     printk("\n");
 
@@ -621,10 +816,13 @@ static int find_indirect_block(int parent, int block_no, int level, int new_bloc
     if (indirect_block[no] == -1) {
         if (new_block == -1)
             return -1;
+        // no space, the caller frees the data block
         int new_indirect_block = alloc_block();
+        if (new_indirect_block == -1)
+            return -1;
         indirect_block[no] = new_indirect_block;
         write_block(parent);
-        indirect_block = (int *) get_block(new_indirect_block);
+        indirect_block = (int *) get_empty_block(new_indirect_block);
         for (int i=0; i<addr_num_per_block; i++)
             indirect_block[i] = -1;
         write_block(new_indirect_block);
@@ -635,9 +833,226 @@ static int find_indirect_block(int parent, int block_no, int level, int new_bloc
     return find_indirect_block(indirect_block[no], block_no % addr_num_per_block_pow, level-1, new_block);
 }
 
+static void free_indirect_block(int parent, int level) {
+    // free all blocks referenced by a (level+1)-level indirect block, and itself
+    pin_block(parent);
+    int *indirect_block = (int *) get_block(parent);
+    for (int i=0; i<BLOCK_SIZE_BYTE/sizeof(int); i++) {
+        if (indirect_block[i] == -1)
+            continue;
+        if (level == 0) {
+            free_block(indirect_block[i]);
+        } else {
+            free_indirect_block(indirect_block[i], level-1);
+        }
+    }
+    unpin_block(parent);
+    free_block(parent);
+}
+
+static int is_extent_inode(inode_t *inode) {
+    return superblock.mapping == FS_MAP_EXTENT && inode->type == INODE_FILE;
+}
+
+static int extent_search(extent_t *extents, int num, int block_no) {
+    // binary search the last extent starting at or before block_no, -1 if none
+    int l = 0, r = num;
+    while (l < r) {
+        int mid = (l + r) / 2;
+        if (extents[mid].start <= block_no)
+            l = mid + 1;
+        else
+            r = mid;
+    }
+    return l - 1;
+}
+
+static int extent_leaf_of(inode_t *inode, int block_no) {
+    // index entry of the leaf holding block_no
+    extent_idx_t *idx = (extent_idx_t *) get_block(inode->extent_block);
+    int l = 1, r = inode->extent_num;
+    while (l < r) {
+        int mid = (l + r) / 2;
+        if (idx[mid].start <= block_no)
+            l = mid + 1;
+        else
+            r = mid;
+    }
+    return l - 1;
+}
+
+static int insert_extent(extent_t *extents, int *num, int cap, int block_no, int new_block) {
+    // map block_no to new_block, merged into the neighbours if physically contiguous
+    // -1 if a new extent is needed but there are already cap ones
+    int i = extent_search(extents, *num, block_no);
+    int left = i >= 0 && extents[i].start + extents[i].len == block_no &&
+               extents[i].block + extents[i].len == new_block;
+    int right = i+1 < *num && extents[i+1].start == block_no + 1 && extents[i+1].block == new_block + 1;
+    if (left && right) {
+        // fills the gap between them
+        extents[i].len += 1 + extents[i+1].len;
+        for (int j=i+1; j<*num-1; j++)
+            extents[j] = extents[j+1];
+        (*num) --;
+    } else if (left) {
+        extents[i].len ++;
+    } else if (right) {
+        extents[i+1].start --;
+        extents[i+1].block --;
+        extents[i+1].len ++;
+    } else {
+        if (*num == cap)
+            return -1;
+        for (int j=*num; j>i+1; j--)
+            extents[j] = extents[j-1];
+        extents[i+1].start = block_no;
+        extents[i+1].block = new_block;
+        extents[i+1].len = 1;
+        (*num) ++;
+    }
+    return 0;
+}
+
+static int grow_extents(inode_t *inode, int block_no) {
+    // make room for one more extent around block_no, 0 on success
+    if (inode->extent_block == -1) {
+        // inode is full, move extents to the first leaf of a new index block
+        int index = alloc_block();
+        if (index == -1)
+            return -1;
+        int leaf = alloc_block();
+        if (leaf == -1) {
+            free_block(index);
+            return -1;
+        }
+        extent_leaf_t *lb = (extent_leaf_t *) get_empty_block(leaf);
+        memcpy((uint8_t *) lb->extents, (uint8_t *) inode->extents, sizeof(inode->extents));
+        lb->num = inode->extent_num;
+        write_block(leaf);
+        extent_idx_t *idx = (extent_idx_t *) get_empty_block(index);
+        idx[0].start = 0;
+        idx[0].block = leaf;
+        write_block(index);
+        inode->extent_block = index;
+        inode->extent_num = 1;
+        logging(LOG_VERBOSE, "fs", "... move extents to leaf %d under index %d\n", leaf, index);
+        return 0;
+    }
+    // the leaf is full, split it in halves
+    if (inode->extent_num == EXTENT_IDX_NUM)
+        return -1;
+    int k = extent_leaf_of(inode, block_no);
+    int leaf = ((extent_idx_t *) get_block(inode->extent_block))[k].block;
+    int new_leaf = alloc_block();
+    if (new_leaf == -1)
+        return -1;
+    pin_block(leaf);
+    extent_leaf_t *lb = (extent_leaf_t *) get_block(leaf);
+    extent_leaf_t *nb = (extent_leaf_t *) get_empty_block(new_leaf);
+    int half = lb->num / 2;
+    nb->num = lb->num - half;
+    memcpy((uint8_t *) nb->extents, (uint8_t *) &lb->extents[half], nb->num * sizeof(extent_t));
+    lb->num = half;
+    int start = nb->extents[0].start;
+    write_block(leaf);
+    write_block(new_leaf);
+    unpin_block(leaf);
+    extent_idx_t *idx = (extent_idx_t *) get_block(inode->extent_block);
+    for (int j=inode->extent_num; j>k+1; j--)
+        idx[j] = idx[j-1];
+    idx[k+1].start = start;
+    idx[k+1].block = new_leaf;
+    inode->extent_num ++;
+    write_block(inode->extent_block);
+    logging(LOG_VERBOSE, "fs", "... split extent leaf %d at %d to %d\n", leaf, start, new_leaf);
+    return 0;
+}
+
+static int find_extent_block(inode_t *inode, int block_no, int new_block) {
+    // extents in inode, or in the leaf under extent_block
+    extent_t *extents = inode->extents;
+    int *num = &inode->extent_num;
+    int cap = INODE_EXTENT_NUM;
+    int leaf = -1;
+    if (inode->extent_block != -1) {
+        leaf = ((extent_idx_t *) get_block(inode->extent_block))[extent_leaf_of(inode, block_no)].block;
+        extent_leaf_t *lb = (extent_leaf_t *) get_block(leaf);
+        extents = lb->extents;
+        num = &lb->num;
+        cap = EXTENT_LEAF_NUM;
+    }
+
+    int i = extent_search(extents, *num, block_no);
+    if (i >= 0 && block_no < extents[i].start + extents[i].len)
+        return extents[i].block + block_no - extents[i].start;
+    if (new_block == -1)
+        return -1;
+
+    if (insert_extent(extents, num, cap, block_no, new_block) == 0) {
+        if (leaf != -1)
+            write_block(leaf);
+        return new_block;
+    }
+    if (grow_extents(inode, block_no) == -1) {
+        logging(LOG_ERROR, "fs", "... too many extents\n");
+        return -1;
+    }
+    return find_extent_block(inode, block_no, new_block);
+}
+
+static void free_extent_run(extent_t *extents, int num) {
+    for (int i=0; i<num; i++)
+        for (int j=0; j<extents[i].len; j++)
+            free_block(extents[i].block + j);
+}
+
+static void free_extent_blocks(inode_t *inode) {
+    if (inode->extent_block == -1) {
+        free_extent_run(inode->extents, inode->extent_num);
+        return ;
+    }
+    pin_block(inode->extent_block);
+    extent_idx_t *idx = (extent_idx_t *) get_block(inode->extent_block);
+    for (int k=0; k<inode->extent_num; k++) {
+        extent_leaf_t *lb = (extent_leaf_t *) get_block(idx[k].block);
+        free_extent_run(lb->extents, lb->num);
+        free_block(idx[k].block);
+    }
+    unpin_block(inode->extent_block);
+    free_block(inode->extent_block);
+}
+
+static void free_inode_blocks(inode_t *inode) {
+    // NOTE: inode should be held by iget()
+    if (is_extent_inode(inode)) {
+        free_extent_blocks(inode);
+        return ;
+    }
+    for (int i=0; i<DIRECT_BLOCK_NUM; i++) {
+        if (inode->direct_blocks[i] == -1)
+            continue;
+        free_block(inode->direct_blocks[i]);
+    }
+    for (int i=0; i<INDIRECT_BLOCK_L1_NUM; i++) {
+        if (inode->indirect_blocks_l1[i] != -1)
+            free_indirect_block(inode->indirect_blocks_l1[i], 0);
+    }
+    for (int i=0; i<INDIRECT_BLOCK_L2_NUM; i++) {
+        if (inode->indirect_blocks_l2[i] != -1)
+            free_indirect_block(inode->indirect_blocks_l2[i], 1);
+    }
+    for (int i=0; i<INDIRECT_BLOCK_L3_NUM; i++) {
+        if (inode->indirect_blocks_l3[i] != -1)
+            free_indirect_block(inode->indirect_blocks_l3[i], 2);
+    }
+}
+
 static int find_block(inode_t *inode, int block_no, int new_block) {
     logging(LOG_VERBOSE, "fs", "... find_block(inode=0x%x, block_no=%d, new_block=%d)\n", inode, block_no, new_block);
     // NOTE: must write_inode after find_block() if new_block != -1
+    if (is_extent_inode(inode))
+        return find_extent_block(inode, block_no, new_block);
+
     // direct block
     if (block_no < DIRECT_BLOCK_NUM) {
         if (new_block != -1)
@@ -672,8 +1087,10 @@ static int find_block(inode_t *inode, int block_no, int new_block) {
                 if (new_block == -1)
                     return -1;
                 int new_indirect_block = alloc_block();
+                if (new_indirect_block == -1)
+                    return -1;
                 indirect_blocks_lx[level][no] = new_indirect_block;
-                int *indirect_block = (int *) get_block(new_indirect_block);
+                int *indirect_block = (int *) get_empty_block(new_indirect_block);
                 for (int i=0; i<addr_num_per_block; i++)
                     indirect_block[i] = -1;
                 write_block(new_indirect_block);
@@ -689,6 +1106,206 @@ static int find_block(inode_t *inode, int block_no, int new_block) {
     return -1;
 }
 
+static int find_run(inode_t *inode, int block_no, int bno, int max, int alloc) {
+    // count blocks from block_no on which are physically contiguous with bno
+    // if alloc, unmapped blocks are mapped when the next physical block is free
+    int num = 1;
+    while (num < max) {
+        int next = find_block(inode, block_no + num, -1);
+        if (next == -1 && alloc && alloc_block_at(bno + num) != -1) {
+            if (find_block(inode, block_no + num, bno + num) == -1) {
+                free_block(bno + num);
+                break;
+            }
+            next = bno + num;
+        }
+        if (next != bno + num)
+            break;
+        num ++;
+    }
+    return num;
+}
+
+/* delayed allocation: a partial write to an unmapped block stays in memory,
+ * blocks are allocated as a contiguous run when the file is flushed
+ */
+typedef struct dablock {
+    int ino;  // -1 if unused
+    int block_no;
+    uint8_t *data;
+    list_node_t lru;
+} dablock_t;
+
+static dablock_t dablock[NUM_DELALLOC];
+// most recently written at head, flushed from tail under pressure
+static LIST_HEAD(dablock_lru);
+// contiguous pages to write a run at once
+static uint8_t *dablock_stage = NULL;
+
+static void init_delalloc(void) {
+    // NOTE: also called by mkfs, delayed blocks belong to the old fs
+    if (dablock_stage == NULL) {
+        uintptr_t data = allocPage(NUM_DELALLOC);
+        for (int i=0; i<NUM_DELALLOC; i++)
+            dablock[i].data = (uint8_t *) (data + i * BLOCK_SIZE_BYTE);
+        dablock_stage = (uint8_t *) allocPage(MAX_BLOCK_RW);
+    }
+    list_init(&dablock_lru);
+    block_reserved = 0;
+    for (int i=0; i<NUM_DELALLOC; i++) {
+        dablock[i].ino = -1;
+        list_insert(dablock_lru.prev, &dablock[i].lru);
+    }
+}
+
+static dablock_t *delalloc_lookup(int ino, int block_no) {
+    for (int i=0; i<NUM_DELALLOC; i++)
+        if (dablock[i].ino == ino && dablock[i].block_no == block_no)
+            return &dablock[i];
+    return NULL;
+}
+
+static uint8_t *delalloc_get_if(int ino, int block_no) {
+    // delayed data of a block, NULL if it's not delayed
+    dablock_t *da = delalloc_lookup(ino, block_no);
+    return da != NULL ? da->data : NULL;
+}
+
+static void delalloc_drop(dablock_t *da) {
+    block_reserved -= DELALLOC_RESERVE;
+    da->ino = -1;
+    list_delete(&da->lru);
+    list_insert(dablock_lru.prev, &da->lru);
+}
+
+static void delalloc_discard(int ino) {
+    // file is removed, its delayed blocks never reach disk
+    for (int i=0; i<NUM_DELALLOC; i++)
+        if (dablock[i].ino == ino)
+            delalloc_drop(&dablock[i]);
+}
+
+static int delalloc_flush(int ino) {
+    // 0 on success, -1 if some data is lost
+    // sort delayed blocks of ino by block_no
+    dablock_t *das[NUM_DELALLOC];
+    int num = 0;
+    for (int i=0; i<NUM_DELALLOC; i++) {
+        if (dablock[i].ino != ino)
+            continue;
+        int j = num++;
+        for (; j>0 && das[j-1]->block_no > dablock[i].block_no; j--)
+            das[j] = das[j-1];
+        das[j] = &dablock[i];
+    }
+    if (num == 0)
+        return 0;
+
+    // the reservation of these blocks is theirs now
+    delalloc_flushing = 1;
+    int ret = 0;
+    inode_t *inode = iget(ino);
+    for (int i=0; i<num; ) {
+        // a run of logically contiguous blocks gets physically contiguous blocks
+        int block_no = das[i]->block_no;
+        int prev = block_no > 0 ? find_block(inode, block_no-1, -1) : -1;
+        int bno = alloc_block_near(prev == -1 ? -1 : prev + 1);
+        if (bno == -1 || find_block(inode, block_no, bno) == -1) {
+            logging(LOG_ERROR, "fs", "flush inode %d: no space for block %d, data lost\n", ino, block_no);
+            if (bno != -1)
+                free_block(bno);
+            delalloc_drop(das[i++]);
+            ret = -1;
+            continue;
+        }
+        int n = 1;
+        while (i + n < num && n < MAX_BLOCK_RW && das[i+n]->block_no == block_no + n &&
+               alloc_block_at(bno + n) != -1) {
+            if (find_block(inode, block_no + n, bno + n) == -1) {
+                free_block(bno + n);
+                break;
+            }
+            n ++;
+        }
+        for (int j=0; j<n; j++) {
+            memcpy(dablock_stage + j * BLOCK_SIZE_BYTE, das[i+j]->data, BLOCK_SIZE_BYTE);
+            delalloc_drop(das[i+j]);
+        }
+        bcache_write_blocks(superblock.data_offset + bno, n, dablock_stage);
+        logging(LOG_DEBUG, "fs", "... flush inode %d, block %d-%d to %d-%d\n", ino, block_no, block_no + n - 1, bno, bno + n - 1);
+        i += n;
+    }
+    delalloc_flushing = 0;
+    write_inode(ino);
+    iput(ino);
+    write_superblock();
+    return ret;
+}
+
+static uint8_t *delalloc_get(int ino, int block_no) {
+    // NULL if the block can't be reserved, the disk is full
+    dablock_t *da = delalloc_lookup(ino, block_no);
+    if (da == NULL) {
+        da = list_entry(dablock_lru.prev, dablock_t, lru);
+        if (da->ino != -1) {
+            // memory pressure, flush the whole file of the oldest one
+            if (delalloc_flush(da->ino) != 0)
+                logging(LOG_ERROR, "fs", "flush inode %d under pressure: data lost\n", da->ino);
+            da = list_entry(dablock_lru.prev, dablock_t, lru);
+        }
+        // the block itself and the mapping blocks it may need
+        if (!block_available(DELALLOC_RESERVE))
+            return NULL;
+        block_reserved += DELALLOC_RESERVE;
+        da->ino = ino;
+        da->block_no = block_no;
+        memset((void *) da->data, 0, BLOCK_SIZE_BYTE);
+    }
+    list_delete(&da->lru);
+    list_insert(&dablock_lru, &da->lru);
+    return da->data;
+}
+
+static int delalloc_pending(int ino) {
+    for (int i=0; i<NUM_DELALLOC; i++)
+        if (dablock[i].ino == ino)
+            return 1;
+    return 0;
+}
+
+int delalloc_sync(void) {
+    // flush every file with delayed blocks, by sync and timer, -1 if some data is lost
+    int ret = 0;
+    for (int i=0; i<NUM_DELALLOC; i++)
+        if (dablock[i].ino != -1 && delalloc_flush(dablock[i].ino) != 0)
+            ret = -1;
+    return ret;
+}
+
+static void readahead(inode_t *inode, int block_no, int *ra_size, int *ra_end) {
+    // a sequential reader is at block_no, keep the window ahead of it
+    // prefetch again when half of the window is consumed, and double the window
+    if (block_no < *ra_end - *ra_size / 2)
+        return ;
+    *ra_size = *ra_size == 0 ? READAHEAD_MIN : *ra_size * 2;
+    if (*ra_size > READAHEAD_MAX)
+        *ra_size = READAHEAD_MAX;
+    int start = *ra_end > block_no ? *ra_end : block_no;
+    int end = block_no + *ra_size;
+    int size = ROUND(inode->size, BLOCK_SIZE_BYTE) / BLOCK_SIZE_BYTE;
+    if (end > size)
+        end = size;
+    for (int i=start; i<end; i++) {
+        int bno = find_block(inode, i, -1);
+        if (bno == -1)
+            break;
+        bcache_prefetch(superblock.data_offset + bno);
+    }
+    if (start < end)
+        logging(LOG_VERBOSE, "fs", "readahead block %d-%d, window=%d\n", start, end - 1, *ra_size);
+    *ra_end = end;
+}
+
 int do_cat(char *path) {
     if (!is_fs_avaliable()) {
         logging(LOG_ERROR, "fs", "cat: no file system found\n");
@@ -710,14 +1327,21 @@ int do_cat(char *path) {
 
     int remain = inode->size;
     int block_no = 0;
+    int ra_size = 0, ra_end = 0;
+    iget(ino);
 
     while (remain > 0) {
         int bno = find_block(inode, block_no, -1);
-        if (bno == -1) {
-            logging(LOG_WARNING, "fs", "... no more block to read\n");
-            break;
+        uint8_t *delayed = NULL;
+        if (bno == -1 && (delayed = delalloc_get_if(ino, block_no)) == NULL) {
+            // hole, nothing printable in it
+            block_no += 1;
+            remain -= BLOCK_SIZE_BYTE;
+            continue;
         }
-        char *block = get_block(bno);
+        if (delayed == NULL)
+            readahead(inode, block_no, &ra_size, &ra_end);
+        char *block = delayed != NULL ? (char *) delayed : get_block(bno);
         int len = remain > PAGE_SIZE ? PAGE_SIZE : remain;
         logging(LOG_DEBUG, "fs", "... read %d bytes from block %d\n", len, bno);
 
@@ -727,11 +1351,69 @@ int do_cat(char *path) {
         block_no += 1;
         remain -= BLOCK_SIZE_BYTE;
     }
+    iput(ino);
     printk("\n");
 
     return 0;  // do_cat succeeds
 }
 
+static file_t **get_fdtable(void) {
+    // threads share opened files with their process
+    pcb_t *self = current_running[get_current_cpu_id()];
+    if (self->type == TYPE_PROCESS)
+        return self->fdtable;
+    pcb_t *parent = get_parent(self->pid);
+    return parent != NULL ? parent->fdtable : self->fdtable;
+}
+
+static file_t *alloc_file(void) {
+    // NULL if the table can't grow
+    if (list_is_empty(&free_files)) {
+        // NOTE: entries are reused through free_files, chunks are never freed
+        file_t *files = (file_t *) kmalloc(FILE_TABLE_CHUNK * sizeof(file_t));
+        if (files == NULL)
+            return NULL;
+        for (int i=0; i<FILE_TABLE_CHUNK; i++) {
+            files[i].ref = 0;
+            list_insert(free_files.prev, &files[i].list);
+        }
+        file_table_size += FILE_TABLE_CHUNK;
+        logging(LOG_INFO, "fs", "open-file table grows to %d\n", file_table_size);
+    }
+    file_t *f = list_entry(free_files.next, file_t, list);
+    list_delete(&f->list);
+    return f;
+}
+
+static int put_file(file_t *f) {
+    // -1 if delayed data of the file can't be written on the last close
+    if (-- f->ref > 0)
+        return 0;
+    int ret = delalloc_flush(f->ino);
+    iput(f->ino);
+    f->inode = NULL;
+    list_insert(&free_files, &f->list);
+    return ret;
+}
+
+void close_all_files(file_t **fdtable) {
+    for (int i=0; i<NUM_FDESCS; i++) {
+        if (fdtable[i] != NULL) {
+            put_file(fdtable[i]);
+            fdtable[i] = NULL;
+        }
+    }
+}
+
+void dup_all_files(file_t **dst, file_t **src) {
+    // fork: dst shares every opened file with src, including the read / write pointers
+    for (int i=0; i<NUM_FDESCS; i++) {
+        dst[i] = src[i];
+        if (dst[i] != NULL)
+            dst[i]->ref ++;
+    }
+}
+
 int do_fopen(char *path, int mode) {
     pcb_t *self = current_running[get_current_cpu_id()];
     logging(LOG_INFO, "fs", "%d.%s.%d do fopen\n", self->pid, self->name, self->tid);
@@ -767,20 +1449,24 @@ int do_fopen(char *path, int mode) {
         return -1;
     }
 
+    file_t **fdtable = get_fdtable();
     for (int i=0; i<NUM_FDESCS; i++) {
-        if (fdesc_array[i].ino == ino) {
-            logging(LOG_ERROR, "fs", "fopen: file already opened\n");
-            return -1;
-        }
-    }
-
-    for (int i=0; i<NUM_FDESCS; i++) {
-        if (fdesc_array[i].ino == -1) {
-            fdesc_array[i].ino = ino;
-            fdesc_array[i].wp = 0;
-            fdesc_array[i].rp = 0;
-            fdesc_array[i].mode = mode;
-            fdesc_array[i].owner = self->pid;
+        if (fdtable[i] == NULL) {
+            file_t *f = alloc_file();
+            if (f == NULL) {
+                logging(LOG_ERROR, "fs", "fopen: no memory for open-file table\n");
+                return -1;
+            }
+            f->ino = ino;
+            f->inode = iget(ino);
+            f->wp = 0;
+            f->rp = 0;
+            f->ra_pos = 0;
+            f->ra_size = 0;
+            f->ra_end = 0;
+            f->mode = mode;
+            f->ref = 1;
+            fdtable[i] = f;
             logging(LOG_INFO, "fs", "... fd=%d\n", i);
             return i;
         }
@@ -790,21 +1476,15 @@ int do_fopen(char *path, int mode) {
     return -1;
 }
 
-static int check_fd(int fd, char *funcname) {
-    pcb_t *self = current_running[get_current_cpu_id()];
+static file_t *get_file(int fd, char *funcname) {
     if (fd < 0 || fd >= NUM_FDESCS) {
         logging(LOG_ERROR, "fs", "%s: invalid fd\n", funcname);
-        return 0;
+        return NULL;
     }
-    if (fdesc_array[fd].ino == -1) {
+    file_t *f = get_fdtable()[fd];
+    if (f == NULL)
         logging(LOG_ERROR, "fs", "%s: fd not opened\n", funcname);
-        return 0;
-    }
-    if (fdesc_array[fd].owner != self->pid) {
-        logging(LOG_ERROR, "fs", "%s: fd not owned by current process\n", funcname);
-        return 0;
-    }
-    return 1;
+    return f;
 }
 
 int do_fread(int fd, char *buff, int length) {
@@ -817,40 +1497,77 @@ int do_fread(int fd, char *buff, int length) {
         return -1;
     }
 
-    if (!check_fd(fd, "fread")) {
+    file_t *f = get_file(fd, "fread");
+    if (f == NULL)
         return -1;
-    }
 
-    if (fdesc_array[fd].mode == O_WRONLY) {
+    if (f->mode == O_WRONLY) {
         logging(LOG_ERROR, "fs", "fread: fd not opened for reading\n");
         return -1;
     }
 
+    inode_t *inode = f->inode;
+    // nothing to read beyond end of file
+    if (f->rp >= inode->size)
+        return 0;
+    if (length > inode->size - f->rp)
+        length = inode->size - f->rp;
+
     int remain = length;
-    int block_no = fdesc_array[fd].rp / BLOCK_SIZE_BYTE;
-    int offset = fdesc_array[fd].rp % BLOCK_SIZE_BYTE;
-    inode_t *inode = get_inode(fdesc_array[fd].ino);
+    int block_no = f->rp / BLOCK_SIZE_BYTE;
+    int offset = f->rp % BLOCK_SIZE_BYTE;
 
     logging(LOG_DEBUG, "fs", "... block_no=%d, offset=%d\n", block_no, offset);
 
+    // sequential if it goes on from where the last read stopped
+    int seq = f->rp == f->ra_pos;
+    if (!seq)
+        f->ra_size = f->ra_end = 0;
+
     while (remain > 0) {
         int bno = find_block(inode, block_no, -1);
-        if (bno == -1) {
-            logging(LOG_WARNING, "fs", "... no more block to read\n");
-            return length - remain;
+        uint8_t *delayed = NULL;
+        if (bno == -1 && (delayed = delalloc_get_if(f->ino, block_no)) == NULL) {
+            // hole, reads back as zeros without touching disk
+            int len = remain > BLOCK_SIZE_BYTE - offset ? BLOCK_SIZE_BYTE - offset : remain;
+            memset((void *) buff, 0, len);
+            logging(LOG_DEBUG, "fs", "... read %d bytes from hole at block %d\n", len, block_no);
+
+            block_no += 1;
+            buff += len;
+            f->rp += len;
+            remain -= BLOCK_SIZE_BYTE - offset;
+            offset = 0;
+            continue;
+        }
+        // whole blocks: read a physically contiguous run at once
+        int num = offset == 0 && delayed == NULL ? find_run(inode, block_no, bno, remain / BLOCK_SIZE_BYTE, 0) : 1;
+        if (num > 1) {
+            int len = num * BLOCK_SIZE_BYTE;
+            bcache_read_blocks(superblock.data_offset + bno, num, (uint8_t *) buff);
+            logging(LOG_DEBUG, "fs", "... read %d bytes from block %d-%d\n", len, bno, bno + num - 1);
+
+            block_no += num;
+            buff += len;
+            f->rp += len;
+            remain -= len;
+            continue;
         }
-        char *block = get_block(bno);
+
+        if (seq && delayed == NULL)
+            readahead(inode, block_no, &f->ra_size, &f->ra_end);
+        char *block = delayed != NULL ? (char *) delayed : get_block(bno);
         int len = remain > BLOCK_SIZE_BYTE - offset ? BLOCK_SIZE_BYTE - offset : remain;
         memcpy((uint8_t *) buff, (uint8_t *) block + offset, len);
         logging(LOG_DEBUG, "fs", "... read %d bytes from block %d\n", len, bno);
 
         block_no += 1;
         buff += len;
-        fdesc_array[fd].rp += len;
+        f->rp += len;
         remain -= BLOCK_SIZE_BYTE - offset;
         offset = 0;
     }
-
+    f->ra_pos = f->rp;
     return length;  // return the length of trully read data
 }
 
@@ -864,37 +1581,88 @@ int do_fwrite(int fd, char *buff, int length) {
         return -1;
     }
 
-    if (!check_fd(fd, "fwrite")) {
+    file_t *f = get_file(fd, "fwrite");
+    if (f == NULL)
         return -1;
-    }
 
-    if (fdesc_array[fd].mode == O_RDONLY) {
+    if (f->mode == O_RDONLY) {
         logging(LOG_ERROR, "fs", "fwrite: fd not opened for writing\n");
         return -1;
     }
 
     int remain = length;
-    int block_no = fdesc_array[fd].wp / BLOCK_SIZE_BYTE;
-    int offset = fdesc_array[fd].wp % BLOCK_SIZE_BYTE;
-    inode_t *inode = get_inode(fdesc_array[fd].ino);
+    int block_no = f->wp / BLOCK_SIZE_BYTE;
+    int offset = f->wp % BLOCK_SIZE_BYTE;
+    inode_t *inode = f->inode;
 
     logging(LOG_DEBUG, "fs", "... block_no=%d, offset=%d\n", block_no, offset);
 
     while (remain > 0) {
         int bno = find_block(inode, block_no, -1);
+        int whole = offset == 0 && remain >= 2 * BLOCK_SIZE_BYTE;
+        if (bno == -1 && !whole) {
+            // delayed allocation, block is allocated when the file is flushed
+            uint8_t *block = delalloc_get(f->ino, block_no);
+            if (block == NULL) {
+                logging(LOG_ERROR, "fs", "fwrite: no free block\n");
+                break;
+            }
+            int len = remain > BLOCK_SIZE_BYTE - offset ? BLOCK_SIZE_BYTE - offset : remain;
+            memcpy(block + offset, (uint8_t *) buff, len);
+            logging(LOG_DEBUG, "fs", "... write %d bytes to delayed block %d\n", len, block_no);
+
+            block_no += 1;
+            buff += len;
+            f->wp += len;
+            remain -= BLOCK_SIZE_BYTE - offset;
+            offset = 0;
+            continue;
+        }
+        if (whole && delalloc_pending(f->ino)) {
+            // a run write must not allocate over delayed blocks
+            if (delalloc_flush(f->ino) != 0) {
+                logging(LOG_ERROR, "fs", "fwrite: failed to flush delayed blocks\n");
+                break;
+            }
+            bno = find_block(inode, block_no, -1);
+        }
+        int is_new = 0;
         if (bno == -1) {
-            // new block needed
-            int new_block = alloc_block();
-            if (new_block == -1) {
+            // new block needed, try to follow the previous one
+            int prev = block_no > 0 ? find_block(inode, block_no-1, -1) : -1;
+            int new_bno = alloc_block_near(prev == -1 ? -1 : prev + 1);
+            if (new_bno == -1) {
                 logging(LOG_ERROR, "fs", "fwrite: no free block\n");
                 break;
             }
             // write new block to inode
-            bno = find_block(inode, block_no, new_block);
-            logging(LOG_DEBUG, "fs", "... alloc block %d for inode %d\n", new_block, fdesc_array[fd].ino);
+            bno = find_block(inode, block_no, new_bno);
+            if (bno == -1) {
+                logging(LOG_ERROR, "fs", "fwrite: file too large or no indirect block\n");
+                free_block(new_bno);
+                break;
+            }
+            logging(LOG_DEBUG, "fs", "... alloc block %d for inode %d\n", new_bno, f->ino);
+            is_new = 1;
+        }
+
+        // whole blocks: write a physically contiguous run through to disk at once
+        int num = offset == 0 ? find_run(inode, block_no, bno, remain / BLOCK_SIZE_BYTE, 1) : 1;
+        if (num > 1) {
+            int len = num * BLOCK_SIZE_BYTE;
+            bcache_write_blocks(superblock.data_offset + bno, num, (uint8_t *) buff);
+            logging(LOG_DEBUG, "fs", "... write %d bytes to block %d-%d\n", len, bno, bno + num - 1);
+
+            block_no += num;
+            buff += len;
+            f->wp += len;
+            remain -= len;
+            continue;
         }
+
+        // nothing to read from a new block
+        char *block = is_new ? get_empty_block(bno) : get_block(bno);
         // write data to block
-        char *block = get_block(bno);
         int len = remain > BLOCK_SIZE_BYTE - offset ? BLOCK_SIZE_BYTE - offset : remain;
         memcpy((uint8_t *) (block + offset), (uint8_t *) buff, len);
         write_block(bno);
@@ -902,13 +1670,13 @@ int do_fwrite(int fd, char *buff, int length) {
 
         block_no += 1;
         buff += len;
-        fdesc_array[fd].wp += len;
+        f->wp += len;
         remain -= BLOCK_SIZE_BYTE - offset;
         offset = 0;
     }
 
-    inode->size = max(fdesc_array[fd].wp, inode->size);
-    write_inode(fdesc_array[fd].ino);
+    inode->size = max(f->wp, inode->size);
+    write_inode(f->ino);
 
     write_superblock();
 
@@ -925,11 +1693,15 @@ int do_fclose(int fd) {
         return -1;
     }
 
-    if (!check_fd(fd, "fclose")) {
+    file_t *f = get_file(fd, "fclose");
+    if (f == NULL)
         return -1;
-    }
 
-    fdesc_array[fd].ino = -1;
+    get_fdtable()[fd] = NULL;
+    if (put_file(f) != 0) {
+        logging(LOG_ERROR, "fs", "fclose: delayed data is lost\n");
+        return -1;
+    }
     logging(LOG_INFO, "fs", "... closed\n", fd);
 
     return 0;  // do_fclose succeeds
@@ -975,37 +1747,18 @@ int do_ln(char *src_path, char *dst_path) {
     inode->link ++;
     write_inode(src_ino);
 
-    // find a invalid dentry and ln
-    int success = 0;
+    // add dentry to parent dir
     logging(LOG_INFO, "fs", "... ln \"%s\" in inode=%d\n", name, pino);
-    for (int i=0; i<DIRECT_BLOCK_NUM && !success; i++) {
-        inode_t *inode = get_inode(pino);
-        dentry_t *dentry;
-        if (inode->direct_blocks[i] == -1) {
-            // all blocks are full, alloc a new block
-            inode->direct_blocks[i] = alloc_block();
-            logging(LOG_VERBOSE, "fs", "... all direct blocks full, alloc a new one\n");
-            inode->size += 4096;
-            write_inode(pino);
-            // clear the new block
-            memset((void *) buf[0], 0, BLOCK_SIZE_BYTE);
-            dentry = (dentry_t *) buf[0];
-        } else {
-            dentry = (dentry_t *) get_block(inode->direct_blocks[i]);
-        }
-        logging(LOG_VERBOSE, "fs", "... searching direct_blocks[%d] at %d\n", i, inode->direct_blocks[i]);
-        for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(dentry_t); j++) {
-            if (!dentry[j].valid) {
-                logging(LOG_VERBOSE, "fs", "... found empty entry at %d\n", j);
-                dentry[j].valid = 1;
-                dentry[j].ino = src_ino;
-                strcpy(dentry[j].name, name);
-                write_block(inode->direct_blocks[i]);
-                success = 1;
-                break;
-            }
-        }
+    if (dir_add(pino, name, src_ino) == -1) {
+        inode = get_inode(src_ino);
+        inode->link --;
+        write_inode(src_ino);
+        write_superblock();
+        logging(LOG_ERROR, "fs", "ln failed\n");
+        return -1;
     }
+    dcache_remove(pino, name);
+    write_superblock();
 
     return 0;  // do_ln succeeds
 }
@@ -1048,75 +1801,24 @@ int do_rm(char *path) {
     write_inode(ino);
     int remove = inode->link == 0;
 
-    // find ino's dentry in dino
-    int success = 0;
-    logging(LOG_INFO, "fs", "... rmdir \"%s\" in inode=%d\n", name, pino);
-    inode = get_inode(pino);
-    for (int i=0; i<DIRECT_BLOCK_NUM && !success; i++) {
-        if (inode->direct_blocks[i] == -1)
-            break;
-        dentry_t *dentry = (dentry_t *) get_block(inode->direct_blocks[i]);
-        logging(LOG_DEBUG, "fs", "... searching direct_blocks[%d] at %d\n", i, inode->direct_blocks[i]);
-        for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(dentry_t); j++) {
-            if (dentry[j].valid && dentry[j].ino == ino) {
-                logging(LOG_DEBUG, "fs", "... found entry at %d\n", j);
-                dentry[j].valid = 0;
-                write_block(inode->direct_blocks[i]);
-                success = 1;
-                break;
-            }
-        }
-    }
+    // remove ino's dentry in pino
+    logging(LOG_INFO, "fs", "... rm \"%s\" in inode=%d\n", name, pino);
+    int success = dir_remove(pino, name, ino) == 0;
 
     if (success) {
+        dcache_remove(pino, name);
         if (remove) {
             // pino's link --
+            inode = get_inode(pino);
             inode->link --;
             write_inode(pino);
 
             // remove ino's blocks
+            delalloc_discard(ino);
             inode = get_inode(ino);
-            for (int i=0; i<DIRECT_BLOCK_NUM; i++) {
-                if (inode->direct_blocks[i] == -1)
-                    continue;
-                free_block(inode->direct_blocks[i]);
-            }
-            for (int i=0; i<INDIRECT_BLOCK_L1_NUM; i++) {
-                if (inode->indirect_blocks_l1[i] == -1)
-                    continue;
-                int *indirect_block = get_block(inode->indirect_blocks_l1[i]);
-                for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(int); j++) {
-                    if (indirect_block[j] == -1)
-                        continue;
-                    free_block(indirect_block[j]);
-                }
-                free_block(inode->indirect_blocks_l1[i]);
-            }
-            for (int i=0; i<INDIRECT_BLOCK_L2_NUM; i++) {
-                if (inode->indirect_blocks_l2[i] == -1)
-                    continue;
-                int *indirect_block = get_block(inode->indirect_blocks_l2[i]);
-                for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(int); j++) {
-                    if (indirect_block[j] == -1)
-                        continue;
-                    free_block(indirect_block[j]);
-                }
-                free_block(inode->indirect_blocks_l2[i]);
-            }
-            for (int i=0; i<INDIRECT_BLOCK_L3_NUM; i++) {
-                if (inode->indirect_blocks_l3[i] == -1)
-                    continue;
-                int *indirect_block = get_block(inode->indirect_blocks_l3[i]);
-                for (int j=0; j<BLOCK_SIZE_BYTE/sizeof(int); j++) {
-                    if (indirect_block[j] == -1)
-                        continue;
-                    free_block(indirect_block[j]);
-                }
-                free_block(inode->indirect_blocks_l3[i]);
-            }
-
-            // FIXME: l2 & l3 blocks are not implemented due to block cache issue
-
+            iget(ino);
+            free_inode_blocks(inode);
+            iput(ino);
             free_inode(ino);
 
             // write superblock
@@ -1132,6 +1834,11 @@ int do_rm(char *path) {
     return 0;  // do_rm succeeds
 }
 
+static int is_data_block(file_t *f, int block_no) {
+    // blocks never written are holes, no indirect block is created to find out
+    return find_block(f->inode, block_no, -1) != -1 || delalloc_get_if(f->ino, block_no) != NULL;
+}
+
 int do_lseek(int fd, int offset, int whence) {
     pcb_t *self = current_running[get_current_cpu_id()];
     logging(LOG_INFO, "fs", "%d.%s.%d do lseek\n", self->pid, self->name, self->tid);
@@ -1142,29 +1849,136 @@ int do_lseek(int fd, int offset, int whence) {
         return -1;
     }
 
-    if (!check_fd(fd, "lseek")) {
+    file_t *f = get_file(fd, "lseek");
+    if (f == NULL)
         return -1;
-    }
 
     int new_wp, new_rp;
     if (whence == SEEK_SET) {
         new_wp = offset;
         new_rp = offset;
     } else if (whence == SEEK_CUR) {
-        new_wp = fdesc_array[fd].wp + offset;
-        new_rp = fdesc_array[fd].rp + offset;
+        new_wp = f->wp + offset;
+        new_rp = f->rp + offset;
     } else if (whence == SEEK_END) {
-        inode_t *inode = get_inode(fdesc_array[fd].ino);
+        inode_t *inode = f->inode;
         new_wp = inode->size + offset;
         new_rp = inode->size + offset;
+    } else if (whence == SEEK_DATA || whence == SEEK_HOLE) {
+        // next data / hole at or after offset, end of file counts as a hole
+        inode_t *inode = f->inode;
+        if (offset < 0 || offset >= inode->size) {
+            logging(LOG_ERROR, "fs", "lseek: offset beyond end of file\n");
+            return -1;
+        }
+        int data = whence == SEEK_DATA;
+        int size = ROUND(inode->size, BLOCK_SIZE_BYTE) / BLOCK_SIZE_BYTE;
+        int block_no = offset / BLOCK_SIZE_BYTE;
+        while (block_no < size && is_data_block(f, block_no) != data)
+            block_no ++;
+        if (block_no == size && data) {
+            logging(LOG_ERROR, "fs", "lseek: no data after offset\n");
+            return -1;
+        }
+        new_wp = block_no == size ? inode->size : max(offset, block_no * BLOCK_SIZE_BYTE);
+        new_rp = new_wp;
     } else {
         logging(LOG_ERROR, "fs", "lseek: invalid whence\n");
         return -1;
     }
 
-    logging(LOG_INFO, "fs", "... wp: %d->%d, rp: %d->%d\n", fdesc_array[fd].wp, new_wp, fdesc_array[fd].rp, new_rp);
-    fdesc_array[fd].wp = new_wp;
-    fdesc_array[fd].rp = new_rp;
+    logging(LOG_INFO, "fs", "... wp: %d->%d, rp: %d->%d\n", f->wp, new_wp, f->rp, new_rp);
+    f->wp = new_wp;
+    f->rp = new_rp;
+
+    return new_rp;  // the resulting offset location from the beginning of the file
+}
+
+int do_sync(void) {
+    pcb_t *self = current_running[get_current_cpu_id()];
+    logging(LOG_INFO, "fs", "%d.%s.%d do sync\n", self->pid, self->name, self->tid);
+
+    if (!is_fs_avaliable()) {
+        logging(LOG_ERROR, "fs", "sync: no file system found\n");
+        return -1;
+    }
+
+    if (fs_commit() != 0) {
+        logging(LOG_ERROR, "fs", "sync: delayed data is lost\n");
+        return -1;
+    }
+
+    return 0;  // do_sync succeeds
+}
+
+int fs_commit(void) {
+    // one transaction: delayed blocks get allocated, then in-core inodes, bitmaps and superblock
+    // are logged with the blocks naming them
+    // NOTE: called between operations (timer, sync, end of a syscall), never in the middle of one
+    if (!is_fs_avaliable())
+        return 0;
+    int ret = delalloc_sync();
+    icache_sync();
+    write_superblock();
+    bcache_sync();
+    return ret;
+}
+
+void fs_commit_point(void) {
+    // an operation has ended, commit if dirty blocks may not leave room for the next one
+    if (bcache_ndirty() >= BCACHE_DIRTY_LIMIT)
+        fs_commit();
+}
+
+/* file pages for mmap, PAGE_SIZE == BLOCK_SIZE_BYTE */
+int fs_hold_file(int fd, int *writable) {
+    // the mapping keeps its own reference, so the file can be closed after mmap
+    file_t *f = get_file(fd, "mmap");
+    if (f == NULL)
+        return -1;
+    *writable = f->mode != O_RDONLY;
+    iget(f->ino);
+    return f->ino;
+}
+
+void fs_dup_file(int ino) {
+    // another mapping of a held file, e.g. inherited by fork
+    iget(ino);
+}
+
+void fs_release_file(int ino) {
+    iput(ino);
+}
 
-    return 0;  // the resulting offset location from the beginning of the file
+void fs_read_page(int ino, int offset, uint8_t *page) {
+    // NOTE: page is zeroed, holes and the part beyond end of file stay zero
+    inode_t *inode = get_inode(ino);
+    if (offset >= inode->size)
+        return ;
+    int len = min(BLOCK_SIZE_BYTE, inode->size - offset);
+    int block_no = offset / BLOCK_SIZE_BYTE;
+    int bno = find_block(inode, block_no, -1);
+    uint8_t *src = bno != -1 ? (uint8_t *) get_block(bno) : delalloc_get_if(ino, block_no);
+    if (src != NULL)
+        memcpy(page, src, len);
+}
+
+int fs_write_page(int ino, int offset, const uint8_t *page) {
+    // a mapping never extends the file, -1 if a delayed block can't be reserved
+    inode_t *inode = get_inode(ino);
+    if (offset >= inode->size)
+        return 0;
+    int len = min(BLOCK_SIZE_BYTE, inode->size - offset);
+    int block_no = offset / BLOCK_SIZE_BYTE;
+    int bno = find_block(inode, block_no, -1);
+    if (bno != -1) {
+        memcpy((uint8_t *) get_block(bno), page, len);
+        write_block(bno);
+    } else {
+        uint8_t *block = delalloc_get(ino, block_no);
+        if (block == NULL)
+            return -1;
+        memcpy(block, page, len);
+    }
+    return 0;
 }
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <os/fs.h>
+#include <os/kernel.h>
+#include <os/list.h>
+#include <os/string.h>
+#include <printk.h>
+
+#define ICACHE_HASH_SIZE NUM_ICACHE
+
+typedef struct icache {
+    int ino;
+    int ref;
+    int dirty;
+    inode_t inode;
+    list_node_t lru;
+    list_node_t hash;
+} icache_t;
+
+static icache_t icache[NUM_ICACHE];
+
+// most recently used at head, victim taken from tail
+static LIST_HEAD(icache_lru);
+static list_head icache_hash[ICACHE_HASH_SIZE];
+
+// inode table's offset in fs, unit is block
+static uint32_t inode_offset;
+
+// statistics, shown in statfs
+int icache_hit = 0;
+int icache_miss = 0;
+
+static int inode_block(int ino) {
+    return inode_offset + ino / INODE_PER_BLOCK;
+}
+
+static void write_icache(icache_t *ip) {
+    inode_t *table = (inode_t *) bcache_get(inode_block(ip->ino));
+    memcpy((uint8_t *) &table[ip->ino % INODE_PER_BLOCK], (uint8_t *) &ip->inode, sizeof(inode_t));
+    bcache_dirty(inode_block(ip->ino));
+    ip->dirty = 0;
+}
+
+void init_icache(uint32_t offset) {
+    // NOTE: also called by mkfs, everything cached belongs to the old fs
+    inode_offset = offset;
+    list_init(&icache_lru);
+    for (int i=0; i<ICACHE_HASH_SIZE; i++)
+        list_init(&icache_hash[i]);
+    for (int i=0; i<NUM_ICACHE; i++) {
+        icache[i].ino = -1;
+        icache[i].ref = 0;
+        icache[i].dirty = 0;
+        list_init(&icache[i].hash);
+        list_insert(icache_lru.prev, &icache[i].lru);
+    }
+}
+
+static icache_t *icache_lookup(int ino) {
+    list_head *head = &icache_hash[ino % ICACHE_HASH_SIZE];
+    for (list_node_t *p=head->next; p!=head; p=p->next) {
+        icache_t *ip = list_entry(p, icache_t, hash);
+        if (ip->ino == ino)
+            return ip;
+    }
+    return NULL;
+}
+
+static icache_t *icache_evict(int ino) {
+    // find the least recently used inode which is not referenced
+    icache_t *ip = NULL;
+    for (list_node_t *p=icache_lru.prev; p!=&icache_lru; p=p->prev) {
+        icache_t *tmp = list_entry(p, icache_t, lru);
+        if (tmp->ref == 0) {
+            ip = tmp;
+            break;
+        }
+    }
+    if (ip == NULL) {
+        logging(LOG_CRITICAL, "icache", "all inodes are referenced\n");
+        assert(0);
+    }
+    if (ip->ino != -1 && ip->dirty) {
+        logging(LOG_VV, "icache", "evict inode %d, write back\n", ip->ino);
+        write_icache(ip);
+    }
+    list_delete(&ip->hash);
+    ip->ino = ino;
+    list_insert(&icache_hash[ino % ICACHE_HASH_SIZE], &ip->hash);
+    return ip;
+}
+
+static icache_t *icache_find(int ino) {
+    icache_t *ip = icache_lookup(ino);
+    if (ip != NULL) {
+        icache_hit ++;
+    } else {
+        icache_miss ++;
+        ip = icache_evict(ino);
+        inode_t *table = (inode_t *) bcache_get(inode_block(ino));
+        memcpy((uint8_t *) &ip->inode, (uint8_t *) &table[ino % INODE_PER_BLOCK], sizeof(inode_t));
+    }
+    list_delete(&ip->lru);
+    list_insert(&icache_lru, &ip->lru);
+    return ip;
+}
+
+inode_t *icache_get(int ino) {
+    // NOTE: pointer stays valid until the inode is evicted, iget() it to keep it
+    return &icache_find(ino)->inode;
+}
+
+void icache_dirty(int ino) {
+    icache_t *ip = icache_lookup(ino);
+    if (ip == NULL) {
+        logging(LOG_ERROR, "icache", "inode %d is not cached, write discarded\n", ino);
+        return ;
+    }
+    ip->dirty = 1;
+}
+
+inode_t *iget(int ino) {
+    icache_t *ip = icache_find(ino);
+    ip->ref ++;
+    return &ip->inode;
+}
+
+void iput(int ino) {
+    icache_t *ip = icache_lookup(ino);
+    if (ip == NULL || ip->ref == 0) {
+        logging(LOG_ERROR, "icache", "iput inode %d which is not referenced\n", ino);
+        return ;
+    }
+    ip->ref --;
+}
+
+void icache_sync(void) {
+    // write dirty inodes to bcache, inodes in the same block are merged into one write
+    int cnt = 0;
+    for (int i=0; i<NUM_ICACHE; i++) {
+        if (icache[i].ino == -1 || !icache[i].dirty)
+            continue;
+        int block = inode_block(icache[i].ino);
+        inode_t *table = (inode_t *) bcache_get(block);
+        for (int j=i; j<NUM_ICACHE; j++) {
+            if (icache[j].ino == -1 || !icache[j].dirty || inode_block(icache[j].ino) != block)
+                continue;
+            memcpy((uint8_t *) &table[icache[j].ino % INODE_PER_BLOCK], (uint8_t *) &icache[j].inode, sizeof(inode_t));
+            icache[j].dirty = 0;
+            cnt ++;
+        }
+        bcache_dirty(block);
+    }
+    if (cnt)
+        logging(LOG_DEBUG, "icache", "sync %d dirty inodes\n", cnt);
+}
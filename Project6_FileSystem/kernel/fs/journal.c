@@ -0,0 +1,117 @@
+#include <os/blk.h>
+#include <os/fs.h>
+#include <os/kernel.h>
+#include <os/mm.h>
+#include <os/string.h>
+#include <printk.h>
+
+/* journal region: header block at JOURNAL_OFFSET, logged blocks right after it
+ * a transaction is durable once its header (the commit record) is on disk
+ */
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_MAX_BLOCKS (JOURNAL_SIZE - 1)
+
+typedef struct jheader_t {
+    int magic;
+    int seq;
+    int num;            // number of logged blocks, 0 means nothing to replay
+    uint32_t checksum;  // over offsets and logged blocks, detects a torn commit
+    int offsets[JOURNAL_MAX_BLOCKS];  // home of each logged block
+} jheader_t;
+
+static jheader_t *jheader;
+// contiguous pages to log / replay MAX_BLOCK_RW blocks per bios call
+static uint8_t *jbuf;
+static int jseq = 0;
+
+// statistics, shown in statfs
+int journal_commits = 0;
+
+static uint32_t checksum(uint32_t sum, const uint8_t *data, int len) {
+    // FNV-1a over words
+    const uint32_t *w = (const uint32_t *) data;
+    for (int i=0; i<len/4; i++) {
+        sum ^= w[i];
+        sum *= 16777619u;
+    }
+    return sum;
+}
+
+static void write_jheader(void) {
+    blk_write((uintptr_t) jheader, BLOCK_SIZE, FS_START + JOURNAL_OFFSET * BLOCK_SIZE);
+}
+
+static void read_jblocks(int start, int num) {
+    // logged blocks [start, start+num) -> jbuf
+    blk_read((uintptr_t) jbuf, num * BLOCK_SIZE, FS_START + (JOURNAL_OFFSET + 1 + start) * BLOCK_SIZE);
+}
+
+void journal_commit(int num, int *offsets, uint8_t **data) {
+    // NOTE: num <= JOURNAL_MAX_BLOCKS, guaranteed by NUM_BCACHE
+    uint32_t sum = checksum(2166136261u, (uint8_t *) offsets, num * sizeof(int));
+    for (int i=0; i<num; i+=MAX_BLOCK_RW) {
+        int n = num - i > MAX_BLOCK_RW ? MAX_BLOCK_RW : num - i;
+        for (int j=0; j<n; j++) {
+            memcpy(jbuf + j * BLOCK_SIZE_BYTE, data[i+j], BLOCK_SIZE_BYTE);
+            sum = checksum(sum, data[i+j], BLOCK_SIZE_BYTE);
+        }
+        blk_write((uintptr_t) jbuf, n * BLOCK_SIZE, FS_START + (JOURNAL_OFFSET + 1 + i) * BLOCK_SIZE);
+    }
+
+    // commit record
+    jheader->magic = JOURNAL_MAGIC;
+    jheader->seq = ++ jseq;
+    jheader->num = num;
+    jheader->checksum = sum;
+    memcpy((uint8_t *) jheader->offsets, (uint8_t *) offsets, num * sizeof(int));
+    write_jheader();
+    journal_commits ++;
+    logging(LOG_DEBUG, "journal", "commit seq=%d, %d blocks\n", jseq, num);
+}
+
+void journal_clear(void) {
+    // all logged blocks are at home, nothing to replay
+    jheader->magic = JOURNAL_MAGIC;
+    jheader->seq = jseq;
+    jheader->num = 0;
+    jheader->checksum = 0;
+    write_jheader();
+}
+
+void init_journal(void) {
+    // NOTE: called before superblock is read, superblock itself may be in the journal
+    jheader = (jheader_t *) allocPage(1);
+    jbuf = (uint8_t *) allocPage(MAX_BLOCK_RW);
+    blk_read((uintptr_t) jheader, BLOCK_SIZE, FS_START + JOURNAL_OFFSET * BLOCK_SIZE);
+    if (jheader->magic != JOURNAL_MAGIC) {
+        logging(LOG_INFO, "journal", "no journal found\n");
+        return ;
+    }
+    jseq = jheader->seq;
+    int num = jheader->num;
+    if (num <= 0 || num > JOURNAL_MAX_BLOCKS)
+        return ;
+
+    // the commit record may be written but blocks may not, check before replay
+    uint32_t sum = checksum(2166136261u, (uint8_t *) jheader->offsets, num * sizeof(int));
+    for (int i=0; i<num; i+=MAX_BLOCK_RW) {
+        int n = num - i > MAX_BLOCK_RW ? MAX_BLOCK_RW : num - i;
+        read_jblocks(i, n);
+        sum = checksum(sum, jbuf, n * BLOCK_SIZE_BYTE);
+    }
+    if (sum != jheader->checksum) {
+        logging(LOG_WARNING, "journal", "seq=%d is torn, discarded\n", jseq);
+        journal_clear();
+        return ;
+    }
+
+    logging(LOG_WARNING, "journal", "replay seq=%d, %d blocks\n", jseq, num);
+    for (int i=0; i<num; i+=MAX_BLOCK_RW) {
+        int n = num - i > MAX_BLOCK_RW ? MAX_BLOCK_RW : num - i;
+        read_jblocks(i, n);
+        for (int j=0; j<n; j++)
+            blk_write((uintptr_t) (jbuf + j * BLOCK_SIZE_BYTE), BLOCK_SIZE,
+                      FS_START + jheader->offsets[i+j] * BLOCK_SIZE);
+    }
+    journal_clear();
+}
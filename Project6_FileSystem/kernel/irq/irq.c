@@ -1,4 +1,6 @@
 #include <os/irq.h>
+#include <os/blk.h>
+#include <os/fs.h>
 #include <os/time.h>
 #include <os/sched.h>
 #include <os/string.h>
@@ -20,6 +22,8 @@ handler_t exc_table[EXCC_COUNT];
 void interrupt_helper(regs_context_t *regs, uint64_t stval, uint64_t scause)
 {
     // interrupt handler.
+    // this hart is in a trap and flushes its tlb below, see flush_tlb_other_harts()
+    tlb_flush_ack();
     // call corresponding handler by the value of `scause`
     handler_t handler;
     long is_irq = scause & SCAUSE_IRQ_FLAG;
@@ -37,14 +41,30 @@ void interrupt_helper(regs_context_t *regs, uint64_t stval, uint64_t scause)
 void handle_irq_timer(regs_context_t *regs, uint64_t stval, uint64_t scause)
 {
     // clock interrupt handler.
-    // Note: use bios_set_timer to reset the timer and remember to reschedule
-    bios_set_timer(get_ticks() + TIMER_INTERVAL);
+    // Note: the timer is reset by do_scheduler() for the next task
+    // skip the disk work if the other hart is in fs / mm, it's done on the next tick
+    if (spin_lock_try_acquire(&mm_lock) == UNLOCKED) {
+        // write back dirty blocks of fs periodically
+        check_bcache_flush();
+        // drain queued disk requests a little at a time
+        check_blk_queue();
+        spin_lock_release(&mm_lock);
+    }
+    do_scheduler();
+}
+
+void handle_irq_soft(regs_context_t *regs, uint64_t stval, uint64_t scause)
+{
+    // ipi from ready_enqueue() to wake up from idle and pick the task,
+    // or from flush_tlb_other_harts(), acked in interrupt_helper()
+    asm volatile("csrw sip, zero");
     do_scheduler();
 }
 
 void handle_page_fault(regs_context_t *regs, uint64_t stval, uint64_t scause) {
     int cid = get_current_cpu_id();
     int code = scause & ~SCAUSE_IRQ_FLAG;
+    task_lock(&mm_lock);
     logging(LOG_DEBUG, "pgfault", "%d.%s.%d epc=0x%x, badaddr=0x%x, tp=%s\n",
             current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid, regs->sepc, stval,
             code == EXCC_INST_PAGE_FAULT ? "INST" : code == EXCC_LOAD_PAGE_FAULT ? "LOAD" : "STORE");
@@ -55,18 +75,36 @@ void handle_page_fault(regs_context_t *regs, uint64_t stval, uint64_t scause) {
     if (pte == NULL) {
         // check if it's on disk
         if (check_and_swap(current_running[cid], stval) == NULL) {
-            // not on disk, try to alloc a new page
-            if (alloc_page_helper(stval, current_running[cid]) == 0) {
+            // not on disk, load it if it's file mapped, otherwise try to alloc a new page
+            int mapped = mmap_fault(current_running[cid], stval, code == EXCC_STORE_PAGE_FAULT);
+            if (mapped == -1) {
+                printk("kernel panic: mmap fault failed\n");
+                do_exit();
+            } else if (mapped == 0 && alloc_page_helper(stval, current_running[cid]) == 0) {
                 // failed to alloc, kill current_running
                 printk("kernel panic: alloc page failed\n");
                 do_exit();
             }
         }
         pte = get_pte_of(stval, current_running[cid]->pgdir, 0);
+    } else if (get_attribute(*pte, _PAGE_COW) && code == EXCC_STORE_PAGE_FAULT) {
+        // frame shared by fork
+        if (cow_fault(current_running[cid], stval) != 0) {
+            printk("kernel panic: copy on write failed\n");
+            do_exit();
+        }
+    } else if (!get_attribute(*pte, _PAGE_WRITE) && code == EXCC_STORE_PAGE_FAULT &&
+               is_mmap_addr(current_running[cid], stval)) {
+        printk("kernel panic: write to read only mapping\n");
+        do_exit();
     } else if (!get_attribute(*pte, _PAGE_WRITE) && code == EXCC_STORE_PAGE_FAULT) {
         // snapshot
         uint64_t kva = pa2kva(get_pa(*pte));
         uint64_t new_kva = alloc_page_helper(stval, current_running[cid]);
+        if (new_kva == 0) {
+            printk("kernel panic: alloc page failed\n");
+            do_exit();
+        }
         memcpy((uint8_t *) new_kva, (uint8_t *) kva, PAGE_SIZE);
         logging(LOG_INFO, "pgfault", "write to snapshot at 0x%lx, copy to 0x%lx\n", kva, new_kva);
     }
@@ -76,6 +114,7 @@ void handle_page_fault(regs_context_t *regs, uint64_t stval, uint64_t scause) {
     } else if (code == EXCC_STORE_PAGE_FAULT) {
         set_attribute(pte, get_attribute(*pte, _PAGE_CTRL_MASK) | _PAGE_ACCESSED | _PAGE_DIRTY);
     }
+    task_unlock(&mm_lock);
     // reflush hardware in interrupt_helper()
 }
 
@@ -87,7 +126,9 @@ void handle_irq_ext(regs_context_t *regs, uint64_t stval, uint64_t scause)
 
     switch (id) {
     case PLIC_E1000_PYNQ_IRQ: case PLIC_E1000_QEMU_IRQ:
+        spin_lock_acquire(&net_lock);
         net_handle_irq();
+        spin_lock_release(&net_lock);
         break;
     default:
         // logging(LOG_WARNING, "irq", "unregistered plic irq, id=%d\n", id);
@@ -113,6 +154,7 @@ void init_exception()
     for (int i=0; i<IRQC_COUNT; i++)
         irq_table[i] = handle_other;
     irq_table[IRQC_S_TIMER] = handle_irq_timer;
+    irq_table[IRQC_S_SOFT] = handle_irq_soft;
     irq_table[IRQC_S_EXT] = handle_irq_ext;
 
     /* set up the entrypoint of exceptions */
@@ -0,0 +1,104 @@
+#include <os/lock.h>
+#include <os/sched.h>
+#include <os/smp.h>
+#include <os/list.h>
+#include <os/mm.h>
+#include <printk.h>
+
+/* futex: the mutex / condition / barrier of tiny_libc/pthread.c live in user memory and
+ * only trap here on contention, to sleep on a word or to wake the sleepers of it
+ * a private word is keyed by (pgdir, va), threads of a process share the pgdir
+ * a word in shm is keyed by its frame, so processes attached at different va meet,
+ * shm is never swapped out (see shm.c)
+ * futexes are protected by mm_lock, the key and the value are read from the page table
+ */
+
+futex_t futexes[FUTEX_NUM];
+
+void init_futexes(void) {
+    for (int i=0; i<FUTEX_NUM; i++)
+        list_init(&futexes[i].block_queue);
+}
+
+static int futex_key(pcb_t *pcb, uintptr_t va, uint64_t *pgdir, uintptr_t *addr) {
+    // 0 on success, -1 if va is not a word in user memory
+    if (va & 3)
+        return -1;
+    if (!is_shm_addr(va)) {
+        *pgdir = pcb->pgdir;
+        *addr = va;
+        return 0;
+    }
+    PTE *pte = get_pte_of(va, pcb->pgdir, 0);
+    if (pte == NULL || !get_attribute(*pte, _PAGE_USER))
+        return -1;
+    *pgdir = 0;
+    *addr = pa2kva(get_pa(*pte)) + (va & (PAGE_SIZE - 1));
+    return 0;
+}
+
+static futex_t *futex_find(uint64_t pgdir, uintptr_t addr, int alloc) {
+    futex_t *free = NULL;
+    for (int i=0; i<FUTEX_NUM; i++) {
+        if (list_is_empty(&futexes[i].block_queue)) {
+            if (free == NULL)
+                free = &futexes[i];
+        } else if (futexes[i].pgdir == pgdir && futexes[i].addr == addr) {
+            return &futexes[i];
+        }
+    }
+    if (!alloc || free == NULL)
+        return NULL;
+    free->pgdir = pgdir;
+    free->addr = addr;
+    return free;
+}
+
+int do_futex_wait(uint32_t *addr, uint32_t val) {
+    // sleep if *addr == val, 0 when woken, 1 if *addr changed, -1 on error
+    int cid = get_current_cpu_id();
+    pcb_t *self = current_running[cid];
+    uintptr_t va = (uintptr_t) addr;
+    uint64_t pgdir;
+    uintptr_t key;
+    if (futex_key(self, va, &pgdir, &key) != 0)
+        return -1;
+    // read it through the kernel mapping, the caller retries if it has been swapped out
+    PTE *pte = get_pte_of(va, self->pgdir, 0);
+    if (pte == NULL)
+        return 1;
+    if (!get_attribute(*pte, _PAGE_USER))
+        return -1;
+    uint32_t now = *(uint32_t *) (pa2kva(get_pa(*pte)) + (va & (PAGE_SIZE - 1)));
+    // the waker's store to *addr is a plain user atomic, not under mm_lock, but it comes before
+    // its do_futex_wake(), which takes mm_lock too, and this check and the enqueue below are
+    // done under mm_lock without releasing it: either the store is seen here, or the wake
+    // runs after the enqueue and finds us, no wakeup is lost
+    if (now != val)
+        return 1;
+    futex_t *futex = futex_find(pgdir, key, 1);
+    if (futex == NULL) {
+        logging(LOG_WARNING, "futex", "%d.%s.%d no futex for 0x%lx\n",
+                self->pid, self->name, self->tid, va);
+        return -1;
+    }
+    logging(LOG_DEBUG, "futex", "%d.%s.%d wait on 0x%lx\n", self->pid, self->name, self->tid, va);
+    do_block(self, &futex->block_queue);
+    return 0;
+}
+
+int do_futex_wake(uint32_t *addr, int num) {
+    // wake at most num waiters of addr, return the number woken
+    int cid = get_current_cpu_id();
+    uint64_t pgdir;
+    uintptr_t key;
+    if (futex_key(current_running[cid], (uintptr_t) addr, &pgdir, &key) != 0)
+        return 0;
+    futex_t *futex = futex_find(pgdir, key, 0);
+    int woken = 0;
+    while (futex != NULL && woken < num && !list_is_empty(&futex->block_queue)) {
+        do_unblock(&futex->block_queue);
+        woken ++;
+    }
+    return woken;
+}
@@ -3,11 +3,14 @@
 #include <os/smp.h>
 #include <os/list.h>
 #include <os/irq.h>
+#include <os/mm.h>
 #include <atomic.h>
 #include <printk.h>
 
 mutex_lock_t mlocks[LOCK_NUM];
 
+spin_lock_t sync_lock;
+
 void init_locks(void) {
     // initialize mlocks
     for (int i=0; i<LOCK_NUM; i++) {
@@ -23,21 +26,36 @@ void spin_lock_init(spin_lock_t *lock) {
 }
 
 int spin_lock_try_acquire(spin_lock_t *lock) {
-    // try to acquire spin lock
-    int status = atomic_swap_d(LOCKED, (ptr_t)&lock->status);
+    // try to acquire spin lock, status is 32 bits and need not be 8 bytes aligned
+    int status = atomic_swap(LOCKED, (ptr_t)&lock->status);
     return status;
 }
 
 void spin_lock_acquire(spin_lock_t *lock) {
     // acquire spin lock
-    while (spin_lock_try_acquire(lock) == LOCKED) ;
+    // the holder may wait for this hart in flush_tlb_other_harts()
+    while (spin_lock_try_acquire(lock) == LOCKED)
+        tlb_flush_ack();
 }
 
 void spin_lock_release(spin_lock_t *lock) {
     // release spin lock
+    __sync_synchronize();
     lock->status = UNLOCKED;
 }
 
+void task_lock(spin_lock_t *lock) {
+    // acquire a kernel lock for current_running, do_scheduler() drops it while the task is blocked
+    spin_lock_acquire(lock);
+    current_running[get_current_cpu_id()]->lock = lock;
+}
+
+void task_unlock(spin_lock_t *lock) {
+    // the task may have been moved to another hart while blocked
+    current_running[get_current_cpu_id()]->lock = NULL;
+    spin_lock_release(lock);
+}
+
 int do_mutex_lock_init(int key) {
     int cid = get_current_cpu_id();
     // disable_preempt();
@@ -119,8 +137,10 @@ void do_mutex_lock_release_f(pid_t pid, pid_t tid) {
     if (pid != current_running[cid]->pid)
         logging(LOG_WARNING, "locking", "%d.%s.%d forced release all mlocks held by pid=%d, tid=%d\n",
                 current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid, pid, tid);
+    spin_lock_acquire(&sync_lock);
     for (int i=0; i<LOCK_NUM; i++) {
         if (mlocks[i].pid == pid && mlocks[i].tid == tid)
             do_mutex_lock_release(i);
     }
+    spin_lock_release(&sync_lock);
 }
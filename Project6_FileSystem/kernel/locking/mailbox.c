@@ -9,29 +9,12 @@
 
 mailbox_t mboxes[MBOX_NUM];
 
-static void _do_mutex_lock_acquire(mutex_lock_t *mlock) {
+/* each mailbox has its own spin lock taken with task_lock(),
+ * do_block() drops it while waiting and takes it again after wakeup
+ */
+static void _do_condition_wait(condition_t *cond) {
     int cid = get_current_cpu_id();
-    // acquire mutex lock
-    if (atomic_swap_d(LOCKED, (ptr_t)(&(mlock->lock.status))) == UNLOCKED) {
-    } else {
-        do_block(current_running[cid], &mlock->block_queue);
-    }
-}
-
-static void _do_mutex_lock_release(mutex_lock_t *mlock) {
-    // release mutex lock
-    if (list_is_empty(&mlock->block_queue)) {
-        mlock->lock.status = UNLOCKED;
-    } else {
-        do_unblock(&mlock->block_queue);
-    }
-}
-
-static void _do_condition_wait(condition_t *cond, mutex_lock_t *mlock) {
-    int cid = get_current_cpu_id();
-    _do_mutex_lock_release(mlock);
     do_block(current_running[cid], &cond->block_queue);
-    _do_mutex_lock_acquire(mlock);
 }
 
 static void _do_condition_signal(condition_t *cond) {
@@ -45,8 +28,7 @@ void init_mbox(void) {
         mboxes[i].rp = 0;
         mboxes[i].allocated = 0;
         // init lock
-        mboxes[i].lock.lock.status = UNLOCKED;
-        list_init(&mboxes[i].lock.block_queue);
+        spin_lock_init(&mboxes[i].lock);
         // init cond
         list_init(&mboxes[i].full.block_queue);
         list_init(&mboxes[i].empty.block_queue);
@@ -94,27 +76,26 @@ void do_mbox_close(int mbox_idx) {
     logging(LOG_INFO, "locking", "%d.%s.%d close mailbox[%d] %s\n",
             current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid, mbox_idx, mboxes[mbox_idx].name);
     if (--mboxes[mbox_idx].allocated == 0) {
+        spin_lock_acquire(&mboxes[mbox_idx].lock);
         mboxes[mbox_idx].size = 0;
         mboxes[mbox_idx].rp = 0;
-        // init lock
-        mboxes[mbox_idx].lock.lock.status = UNLOCKED;
-        list_init(&mboxes[mbox_idx].lock.block_queue);
         // init cond
         list_init(&mboxes[mbox_idx].full.block_queue);
         list_init(&mboxes[mbox_idx].empty.block_queue);
+        spin_lock_release(&mboxes[mbox_idx].lock);
     }
 }
 
 int do_mbox_send(int mbox_idx, void *msg, int msg_length) {
     int cid = get_current_cpu_id();
-    _do_mutex_lock_acquire(&mboxes[mbox_idx].lock);
+    task_lock(&mboxes[mbox_idx].lock);
     int blocked = 0;
     logging(LOG_INFO, "locking", "%d.%s.%d send %d bytes to mailbox[%d] %s\n",
             current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid, msg_length, mbox_idx, mboxes[mbox_idx].name);
     // wait until msgbox is available
     while (MAX_MBOX_LENGTH - mboxes[mbox_idx].size - msg_length < 0) {
         blocked ++;
-        _do_condition_wait(&mboxes[mbox_idx].full, &mboxes[mbox_idx].lock);
+        _do_condition_wait(&mboxes[mbox_idx].full);
     }
     // send
     int wp = (mboxes[mbox_idx].rp + mboxes[mbox_idx].size) % MAX_MBOX_LENGTH;
@@ -125,20 +106,20 @@ int do_mbox_send(int mbox_idx, void *msg, int msg_length) {
     logging(LOG_INFO, "locking", "%d.%s.%d send %d bytes to mailbox[%d] %s + %d, success\n",
             current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid, msg_length, mbox_idx, mboxes[mbox_idx].name, mboxes[mbox_idx].size);
     _do_condition_signal(&mboxes[mbox_idx].empty);
-    _do_mutex_lock_release(&mboxes[mbox_idx].lock);
+    task_unlock(&mboxes[mbox_idx].lock);
     return blocked;
 }
 
 int do_mbox_recv(int mbox_idx, void *msg, int msg_length) {
     int cid = get_current_cpu_id();
-    _do_mutex_lock_acquire(&mboxes[mbox_idx].lock);
+    task_lock(&mboxes[mbox_idx].lock);
     int blocked = 0;
     logging(LOG_INFO, "locking", "%d.%s.%d recv %d bytes from mailbox[%d] %s\n",
             current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid, msg_length, mbox_idx, mboxes[mbox_idx].name);
     // wait until msgbox is available
     while (mboxes[mbox_idx].size < msg_length) {
         blocked ++;
-        _do_condition_wait(&mboxes[mbox_idx].empty, &mboxes[mbox_idx].lock);
+        _do_condition_wait(&mboxes[mbox_idx].empty);
     }
     // recv
     for (int i=0; i<msg_length; i++, mboxes[mbox_idx].rp = (mboxes[mbox_idx].rp + 1) % MAX_MBOX_LENGTH)
@@ -148,6 +129,6 @@ int do_mbox_recv(int mbox_idx, void *msg, int msg_length) {
     logging(LOG_INFO, "locking", "%d.%s.%d recv %d bytes from mailbox[%d] %s success\n",
             current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid, msg_length, mbox_idx, mboxes[mbox_idx].name);
     _do_condition_signal(&mboxes[mbox_idx].full);
-    _do_mutex_lock_release(&mboxes[mbox_idx].lock);
+    task_unlock(&mboxes[mbox_idx].lock);
     return blocked;
 }
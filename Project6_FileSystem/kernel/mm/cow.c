@@ -0,0 +1,105 @@
+#include <os/blk.h>
+#include <os/fs.h>
+#include <os/mm.h>
+#include <os/string.h>
+#include <printk.h>
+
+/* fork() shares user frames between parent and child, writable ones are mapped read only
+ * with _PAGE_COW in both, the first write copies the frame (cow_fault)
+ * NOTE: a shared frame is not swapped out until the sharing is broken
+ */
+
+int copy_user_pages(pcb_t *dst, pcb_t *src) {
+    // src is a process, dst has a new pgdir and an empty page_list
+    // -1 if memory runs out, the caller frees what dst got so far
+    int ret = 0, protected = 0;
+    for (list_node_t *p=src->page_list.next; p!=&src->page_list; p=p->next) {
+        page_t *page = list_entry(p, page_t, list);
+        if (page->tp != PAGE_USER)
+            continue;
+        PTE *src_pte = get_pte_of(page->va, src->pgdir, 4);
+        if (src_pte == NULL)
+            continue;
+        PTE *pte = map_page(page->va, dst->pgdir, &dst->page_list, 0);
+        if (pte == NULL) {
+            ret = -1;
+            break;
+        }
+        page_t *copy = new_page_struct();
+        if (copy == NULL) {
+            ret = -1;
+            break;
+        }
+        copy->tp = PAGE_USER;
+        copy->va = page->va;
+        copy->owner = dst;
+        uint64_t attr;
+        if (page->kva == 0) {
+            // on disk, the child reads its own copy
+            copy->kva = get_frame(1);
+            if (copy->kva == 0) {
+                logging(LOG_ERROR, "cow", "no frame for va=0x%lx\n", page->va);
+                put_page_struct(copy);
+                ret = -1;
+                break;
+            }
+            blk_read(copy->kva, PAGE_SIZE / SECTOR_SIZE, page->swap->pa);
+            attr = get_attribute(*src_pte, _PAGE_CTRL_MASK) | _PAGE_PRESENT;
+            if (attr & _PAGE_COW)
+                attr = (attr & ~_PAGE_COW) | _PAGE_WRITE;
+        } else {
+            attr = get_attribute(*src_pte, _PAGE_CTRL_MASK);
+            if (attr & _PAGE_WRITE) {
+                attr = (attr & ~_PAGE_WRITE) | _PAGE_COW;
+                set_attribute(src_pte, attr);
+                protected = 1;
+            }
+            copy->kva = page->kva;
+            frame_get(page->kva);
+        }
+        set_pfn(pte, kva2pa(copy->kva) >> NORMAL_PAGE_SHIFT);
+        set_attribute(pte, attr);
+        list_insert(&dst->page_list, &copy->list);
+        list_insert(onmem_list.prev, &copy->onmem);
+        logging(LOG_VV, "cow", "... va=0x%lx, kva=0x%lx\n", page->va, copy->kva);
+    }
+    // threads of src on the other hart must not keep writing through stale entries
+    if (protected)
+        flush_tlb_other_harts(src->pgdir);
+    return ret;
+}
+
+int cow_fault(pcb_t *pcb, uintptr_t va) {
+    // write to a _PAGE_COW page, 0 on success
+    // the last user of a frame gets it back writable, others copy it
+    va &= ~(PAGE_SIZE - 1);
+    PTE *pte = get_pte_of(va, pcb->pgdir, 0);
+    uintptr_t kva = pa2kva(get_pa(*pte));
+    int shared = frame_shared(kva);
+    if (shared) {
+        list_head *page_list = get_page_list(pcb);
+        page_t *page = NULL;
+        for (list_node_t *p=page_list->next; p!=page_list; p=p->next) {
+            page_t *tmp = list_entry(p, page_t, list);
+            if (tmp->va == va && tmp->kva == kva && tmp->tp == PAGE_USER) {
+                page = tmp;
+                break;
+            }
+        }
+        uintptr_t new_kva = page != NULL ? get_frame(1) : 0;
+        if (new_kva == 0) {
+            logging(LOG_ERROR, "cow", "unable to copy va=0x%lx\n", va);
+            return -1;
+        }
+        memcpy((uint8_t *) new_kva, (uint8_t *) kva, PAGE_SIZE);
+        frame_put(kva);
+        page->kva = new_kva;
+        set_pfn(pte, kva2pa(new_kva) >> NORMAL_PAGE_SHIFT);
+        logging(LOG_INFO, "cow", "copy 0x%lx to 0x%lx for va=0x%lx\n", kva, new_kva, va);
+    }
+    set_attribute(pte, (get_attribute(*pte, _PAGE_CTRL_MASK) & ~_PAGE_COW) | _PAGE_WRITE);
+    // threads on the other hart may still read the old frame, which its last user will write
+    if (shared)
+        flush_tlb_other_harts(pcb->pgdir);
+    return 0;
+}
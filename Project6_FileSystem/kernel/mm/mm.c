@@ -1,106 +1,263 @@
 #include <assert.h>
+#include <common.h>
+#include <os/fs.h>
 #include <os/mm.h>
 #include <os/pthread.h>
+#include <os/smp.h>
 #include <os/string.h>
+#include <pgtable.h>
 #include <printk.h>
 
-// NOTE: A/C-core
-static ptr_t kernMemCurr = FREEMEM_KERNEL;
-
 // limit page frame to test swap
-/* NOTE: only pages used by user is caculated
+/* NOTE: only pages used by user and buffer cache are caculated
  * pgdir / kernel stack are excluded
  */
-#define PAGEFRAME_LIMIT 20
+#define PAGEFRAME_LIMIT (20 + NUM_BCACHE)
 unsigned remaining_pf = PAGEFRAME_LIMIT;
 
-LIST_HEAD(freepage_list);
+spin_lock_t mm_lock;
+
 LIST_HEAD(onmem_list);
+/* buddy allocator over [FREEMEM_KERNEL, MEM_END)
+ * a free block of 2^order pages is aligned to its size (relative to MEM_BASE),
+ * its first page holds the list node in free_area[order]
+ */
+#define NUM_MEM_PAGE ((MEM_END - MEM_BASE) / PAGE_SIZE)
+static list_head free_area[BUDDY_MAX_ORDER + 1];
+// order + 1 if the page is the head of a free block, 0 otherwise
+static uint8_t free_head[NUM_MEM_PAGE];
+// statistics
+static int free_pages = 0;
+// sharers besides the first one, see cow.c
+static uint8_t frame_ref[NUM_MEM_PAGE];
+
+static list_node_t *block_node(uint64_t idx) {
+    return (list_node_t *) (MEM_BASE + idx * PAGE_SIZE);
+}
+
+static void buddy_free(uint64_t idx, int order) {
+    // merge with the buddy as long as it's free and of the same order
+    free_pages += 1 << order;
+    while (order < BUDDY_MAX_ORDER) {
+        uint64_t buddy = idx ^ (1lu << order);
+        if (buddy >= NUM_MEM_PAGE || free_head[buddy] != order + 1)
+            break;
+        list_delete(block_node(buddy));
+        free_head[buddy] = 0;
+        idx &= ~(1lu << order);
+        order ++;
+    }
+    free_head[idx] = order + 1;
+    list_insert(&free_area[order], block_node(idx));
+}
+
+static void free_range(ptr_t kva, int numPage) {
+    // split the range into the largest aligned blocks
+    uint64_t idx = (kva - MEM_BASE) / PAGE_SIZE;
+    uint64_t end = idx + numPage;
+    while (idx < end) {
+        int order = 0;
+        while (order < BUDDY_MAX_ORDER && !(idx & (1lu << order)) && idx + (2lu << order) <= end)
+            order ++;
+        buddy_free(idx, order);
+        idx += 1lu << order;
+    }
+}
+
+static ptr_t buddy_alloc(int order) {
+    // the smallest free block which is large enough, upper halves go back when split
+    int k = order;
+    while (k <= BUDDY_MAX_ORDER && list_is_empty(&free_area[k]))
+        k ++;
+    if (k > BUDDY_MAX_ORDER)
+        return 0;
+    list_node_t *node = free_area[k].next;
+    list_delete(node);
+    uint64_t idx = ((ptr_t) node - MEM_BASE) / PAGE_SIZE;
+    free_head[idx] = 0;
+    while (k > order) {
+        k --;
+        free_head[idx + (1lu << k)] = k + 1;
+        list_insert(&free_area[k], block_node(idx + (1lu << k)));
+    }
+    free_pages -= 1 << order;
+    return MEM_BASE + idx * PAGE_SIZE;
+}
+
+void init_mm(void) {
+    for (int i=0; i<=BUDDY_MAX_ORDER; i++)
+        list_init(&free_area[i]);
+    ptr_t start = ROUND(FREEMEM_KERNEL, PAGE_SIZE);
+    free_range(start, (MEM_END - start) / PAGE_SIZE);
+    logging(LOG_INFO, "mm", "%d free pages from 0x%lx\n", free_pages, start);
+}
 
 ptr_t allocPage(int numPage)
 {
-    // align PAGE_SIZE
-    ptr_t ret = ROUND(kernMemCurr, PAGE_SIZE);
-    kernMemCurr = ret + numPage * PAGE_SIZE;
+    // contiguous pages, return 0 if there's no such block
+    int order = 0;
+    while ((1 << order) < numPage)
+        order ++;
+    ptr_t ret = order > BUDDY_MAX_ORDER ? 0 : buddy_alloc(order);
+    if (ret == 0) {
+        logging(LOG_CRITICAL, "mm", "unable to alloc %d pages, %d free\n", numPage, free_pages);
+        return 0;
+    }
+    // pages beyond numPage are not used, give them back
+    if ((1 << order) > numPage)
+        free_range(ret + numPage * PAGE_SIZE, (1 << order) - numPage);
     return ret;
 }
 
+void freePage(ptr_t baseAddr, int numPage)
+{
+    free_range(baseAddr, numPage);
+}
+
+void frame_get(uintptr_t kva) {
+    frame_ref[(kva - MEM_BASE) / PAGE_SIZE] ++;
+}
+
+int frame_put(uintptr_t kva) {
+    // drop a sharer, 1 if the frame is still used by others
+    uint64_t idx = (kva - MEM_BASE) / PAGE_SIZE;
+    if (frame_ref[idx] == 0)
+        return 0;
+    frame_ref[idx] --;
+    return 1;
+}
+
+int frame_shared(uintptr_t kva) {
+    return frame_ref[(kva - MEM_BASE) / PAGE_SIZE] != 0;
+}
+
 // NOTE: Only need for S-core to alloc 2MB large page
 #ifdef S_CORE
-static ptr_t largePageMemCurr = LARGE_PAGE_FREEMEM;
 ptr_t allocLargePage(int numPage)
 {
-    // align LARGE_PAGE_SIZE
-    ptr_t ret = ROUND(largePageMemCurr, LARGE_PAGE_SIZE);
-    largePageMemCurr = ret + numPage * LARGE_PAGE_SIZE;
-    return ret;
+    // buddy blocks are aligned to their size, so is a LARGE_PAGE_SIZE one
+    return allocPage(numPage * (LARGE_PAGE_SIZE / PAGE_SIZE));
 }
 #endif
 
 page_t *alloc_page1(void) {
-    page_t *page;
-    if (!list_is_empty(&freepage_list)) {
-        page = list_entry(freepage_list.next, page_t, list);
-        list_delete(freepage_list.next);
-        list_delete(&page->onmem);
-        logging(LOG_VERBOSE, "mm", "reuse page at 0x%lx\n", page->kva);
-    } else {
-        page = (page_t *) kmalloc(sizeof(page_t));
-        page->kva = allocPage(1);
-        list_init(&page->list);
-        list_init(&page->onmem);
-        logging(LOG_VERBOSE, "mm", "allocated a new page at 0x%lx\n", page->kva);
+    // a zeroed page for kernel use, NULL if memory is exhausted
+    uintptr_t kva = allocPage(1);
+    if (kva == 0) {
+        logging(LOG_ERROR, "mm", "out of memory\n");
+        return NULL;
     }
+    page_t *page = new_page_struct();
+    if (page == NULL) {
+        freePage(kva, 1);
+        return NULL;
+    }
+    page->kva = kva;
     page->tp = PAGE_KERNEL;
-    page->va = 0;
-    page->swap = NULL;
-    page->owner = NULL;
+    logging(LOG_VERBOSE, "mm", "allocated a new page at 0x%lx\n", page->kva);
     memset((void *) page->kva, 0, PAGE_SIZE);
     return page;
 }
 
 void free_page1(page_t *page) {
     list_delete(&page->list);
-    if (page->kva == 0) { // not on memory
+    // a page on memory may also keep its swap copy
+    if (page->swap != NULL)
         free_swap1(page->swap);
-        return ;
+    if (page->kva != 0) { // on memory
+        list_delete(&page->onmem);
+        // a frame shared by fork() goes back with its last user
+        if (!frame_put(page->kva)) {
+            freePage(page->kva, 1);
+            if (page->tp == PAGE_USER || page->tp == PAGE_MMAP)
+                remaining_pf ++;
+        }
+        logging(LOG_VERBOSE, "mm", "freed page at 0x%lx\n", page->kva);
     }
-    list_delete(&page->onmem);
-    list_insert(&freepage_list, &page->list);
-    if (page->tp == PAGE_USER)
-        remaining_pf ++;
-    logging(LOG_VERBOSE, "mm", "freed page at 0x%lx\n", page->kva);
+    put_page_struct(page);
 }
 
-void *kmalloc(size_t size) {
-    size = ROUND(size, 4);
-    if (size > PAGE_SIZE) {
-        logging(LOG_ERROR, "mm", "currently unable to kmalloc mem larger than 4K\n");
+page_t *new_page_struct(void) {
+    // NULL if the slab has no room and no page to grow
+    page_t *page = (page_t *) kmalloc(sizeof(page_t));
+    if (page == NULL) {
+        logging(LOG_ERROR, "mm", "no memory for page struct\n");
         return NULL;
     }
-    static size_t remaining = 0;
-    static ptr_t p = 0;
-    if (remaining < size) {
-        // NOTE: this can't be freed
-        remaining = PAGE_SIZE;
-        p = allocPage(1);
-        logging(LOG_INFO, "mm", "allocated a new page at 0x%lx for kmalloc\n", p);
-    }
-    remaining -= size;
-    void *ret = (void *) p;
-    p += size;
-    return ret;
+    list_init(&page->list);
+    list_init(&page->onmem);
+    page->kva = 0;
+    page->va = 0;
+    page->swap = NULL;
+    page->owner = NULL;
+    return page;
+}
+
+void put_page_struct(page_t *page) {
+    // NOTE: page must not be in any list
+    kfree(page);
+}
+
+uintptr_t get_frame(int reclaim) {
+    // a frame counted in PAGEFRAME_LIMIT, when used up the oldest page in onmem_list gives its own
+    // return 0 if there's none
+    uintptr_t kva;
+    if (remaining_pf == 0) {
+        if (!reclaim || (kva = swap_out(reclaim != RECLAIM_NOFS)) == 0)
+            return 0;
+    } else {
+        if ((kva = allocPage(1)) == 0)
+            return 0;
+        remaining_pf --;
+    }
+    memset((void *) kva, 0, PAGE_SIZE);
+    return kva;
+}
+
+void put_frame(uintptr_t kva) {
+    // give a frame taken by get_frame() back
+    freePage(kva, 1);
+    remaining_pf ++;
+}
+
+page_t *alloc_frame(int tp, int reclaim) {
+    // a page of user or buffer cache, they share frames and one reclaim order
+    uintptr_t kva = get_frame(reclaim);
+    if (kva == 0)
+        return NULL;
+    page_t *page = new_page_struct();
+    if (page == NULL) {
+        put_frame(kva);
+        return NULL;
+    }
+    page->kva = kva;
+    page->tp = tp;
+    list_insert(onmem_list.prev, &page->onmem);
+    return page;
 }
 
 void do_garbage_collector(void) {
     for (int i=0; i<NUM_MAX_TASK; i++) {
         if (pcb[i].status == TASK_UNUSED)
             break;
-        if (pcb[i].status != TASK_EXITED || pcb[i].type != TYPE_PROCESS)
+        if (pcb[i].status != TASK_EXITED || pcb[i].collected)
+            continue;
+        // killed while it runs on the other hart, the kernel stack is still in use
+        // a process also waits for its threads, they run on its pages
+        spin_lock_acquire(&sched_lock);
+        int running = 0;
+        for (int j=0; j<NR_CPUS; j++)
+            running |= pcb[i].type == TYPE_PROCESS ? current_running[j]->pid == pcb[i].pid
+                                                   : current_running[j] == &pcb[i];
+        spin_lock_release(&sched_lock);
+        if (running)
             continue;
-        while (!list_is_empty(&pcb[i].page_list)) {
-            free_page1(list_entry(pcb[i].page_list.next, page_t, list));
+        if (pcb[i].type == TYPE_PROCESS) {
+            while (!list_is_empty(&pcb[i].page_list)) {
+                free_page1(list_entry(pcb[i].page_list.next, page_t, list));
+            }
         }
+        pcb[i].collected = 1;
     }
 }
 
@@ -156,6 +313,8 @@ PTE *map_page(uintptr_t va, uint64_t pgdir, list_node_t *page_list, int level) {
     if (!(pt2[vpn2] & _PAGE_PRESENT)) {
         // alloc a new second-level page directory
         page_t *tmp = alloc_page1();
+        if (tmp == NULL)
+            return NULL;
         if (page_list != NULL)
             list_insert(page_list, &tmp->list);
         uintptr_t page = tmp->kva;
@@ -178,6 +337,8 @@ PTE *map_page(uintptr_t va, uint64_t pgdir, list_node_t *page_list, int level) {
         if (!(pt1[vpn1] & _PAGE_PRESENT)) {
             // alloc a new second-level page directory
             page_t *tmp = alloc_page1();
+            if (tmp == NULL)
+                return NULL;
             if (page_list != NULL)
                 list_insert(page_list, &tmp->list);
             uintptr_t page = tmp->kva;
@@ -208,25 +369,20 @@ uintptr_t alloc_page_helper(uintptr_t va, pcb_t *pcb) {
 
     list_node_t *page_list = get_page_list(pcb);
     PTE *pte = map_page(va, pcb->pgdir, &pcb->page_list, 0);
+    if (pte == NULL) {
+        logging(LOG_ERROR, "mm", "no page for the page table of 0x%lx\n", va);
+        return 0;
+    }
 
     // allocate a new page for va
 #ifdef S_CORE
     uintptr_t page = allocLargePage(1);
 #else
-    page_t *tmp;
-    if (remaining_pf == 0) {
-        tmp = (page_t *) kmalloc(sizeof(page_t));
-        tmp->kva = swap_out();
-        list_init(&tmp->list);
-        list_init(&tmp->onmem);
-        memset((void *) tmp->kva, 0, PAGE_SIZE);
-    } else {
-        remaining_pf --;
-        tmp = alloc_page1();
+    page_t *tmp = alloc_frame(PAGE_USER, 1);
+    if (tmp == NULL) {
+        logging(LOG_ERROR, "mm", "no page frame can be reclaimed\n");
+        return 0;
     }
-    tmp->tp = PAGE_USER;
-    tmp->swap = NULL;
-    list_insert(onmem_list.prev, &tmp->onmem);
     list_insert(page_list, &tmp->list);
     tmp->owner = pcb;
     tmp->va = va & ~(PAGE_SIZE - 1);
@@ -241,3 +397,31 @@ uintptr_t alloc_page_helper(uintptr_t va, pcb_t *pcb) {
 
     return page;
 }
+
+/* tlb shootdown: a hart that changed the ptes of a pgdir in use by the other hart
+ * sends it an ipi and waits, the other hart acks once it's in a trap, every trap
+ * does sfence.vma before going back to user (interrupt_helper / do_scheduler)
+ */
+static volatile int tlb_stale[NR_CPUS];
+
+void flush_tlb_other_harts(uintptr_t pgdir) {
+    int self = get_current_cpu_id();
+    // ptes are written before current_running is checked
+    __sync_synchronize();
+    for (int i=0; i<NR_CPUS; i++) {
+        if (i != self && current_running[i] != NULL && current_running[i]->pgdir == pgdir) {
+            tlb_stale[i] = 1;
+            __sync_synchronize();
+            unsigned long hart_mask = 1lu << i;
+            send_ipi(&hart_mask);
+        }
+    }
+    for (int i=0; i<NR_CPUS; i++)
+        while (tlb_stale[i]) ;
+    local_flush_tlb_all();
+}
+
+void tlb_flush_ack(void) {
+    // called in a trap or while spinning on a kernel lock, sfence.vma is done before sret
+    tlb_stale[get_current_cpu_id()] = 0;
+}
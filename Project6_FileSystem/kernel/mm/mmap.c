@@ -0,0 +1,225 @@
+#include <os/fs.h>
+#include <os/mm.h>
+#include <os/pthread.h>
+#include <os/smp.h>
+#include <os/string.h>
+#include <printk.h>
+
+#define MMAP_BASE 0xa0000000
+#define MMAP_LIM ((MMAP_BASE) + 0x10000 * PAGE_SIZE)
+
+mmap_area_t mmap_areas[MMAP_AREA_NUM];
+
+/* NOTE: pages are loaded on fault and written back by msync / munmap / exit,
+ * or by swap_out() which drops them, they are not coherent with fread / fwrite before msync
+ */
+
+static pcb_t *get_process(pcb_t *pcb) {
+    return pcb->type == TYPE_THREAD ? get_parent(pcb->pid) : pcb;
+}
+
+static mmap_area_t *find_area(pid_t pid, uintptr_t va) {
+    for (int i=0; i<MMAP_AREA_NUM; i++)
+        if (mmap_areas[i].valid && mmap_areas[i].pid == pid &&
+            va >= mmap_areas[i].va && va < mmap_areas[i].va + mmap_areas[i].len)
+            return &mmap_areas[i];
+    return NULL;
+}
+
+static uintptr_t find_va(pid_t pid, int len) {
+    // first fit among this process's areas
+    uintptr_t va = MMAP_BASE;
+    for (int i=0; i<MMAP_AREA_NUM; ) {
+        mmap_area_t *a = &mmap_areas[i];
+        if (a->valid && a->pid == pid && va < a->va + a->len && a->va < va + len) {
+            va = a->va + a->len;
+            i = 0;
+            continue;
+        }
+        i ++;
+    }
+    return va + len <= MMAP_LIM ? va : 0;
+}
+
+uintptr_t do_mmap(int fd, int offset, int length) {
+    pcb_t *self = get_process(current_running[get_current_cpu_id()]);
+    if (length <= 0 || offset < 0 || offset % PAGE_SIZE) {
+        logging(LOG_ERROR, "mmap", "invalid offset=%d, length=%d\n", offset, length);
+        return 0;
+    }
+    int len = ROUND(length, PAGE_SIZE);
+    mmap_area_t *area = NULL;
+    for (int i=0; i<MMAP_AREA_NUM; i++) {
+        if (!mmap_areas[i].valid) {
+            area = &mmap_areas[i];
+            break;
+        }
+    }
+    uintptr_t va = find_va(self->pid, len);
+    if (area == NULL || va == 0) {
+        logging(LOG_ERROR, "mmap", "no area / va available\n");
+        return 0;
+    }
+    int writable;
+    int ino = fs_hold_file(fd, &writable);
+    if (ino == -1)
+        return 0;
+
+    area->valid = 1;
+    area->pid = self->pid;
+    area->va = va;
+    area->len = len;
+    area->ino = ino;
+    area->offset = offset;
+    area->writable = writable;
+    logging(LOG_INFO, "mmap", "%d.%s map inode %d [0x%x, 0x%x) at 0x%lx%s\n",
+            self->pid, self->name, ino, offset, offset + len, va, writable ? "" : ", read only");
+    return va;
+}
+
+int mmap_fault(pcb_t *pcb, uintptr_t va, int write) {
+    // 1: page loaded, 0: not a mapped address, -1: illegal access or out of memory
+    pcb = get_process(pcb);
+    mmap_area_t *area = find_area(pcb->pid, va);
+    if (area == NULL)
+        return 0;
+    if (write && !area->writable) {
+        logging(LOG_ERROR, "mmap", "write to read only mapping at 0x%lx\n", va);
+        return -1;
+    }
+    va &= ~(PAGE_SIZE - 1);
+    PTE *pte = map_page(va, pcb->pgdir, &pcb->page_list, 0);
+    // counted in PAGEFRAME_LIMIT, in onmem_list to be reclaimed
+    page_t *page = pte == NULL ? NULL : alloc_frame(PAGE_MMAP, 1);
+    if (page == NULL) {
+        logging(LOG_ERROR, "mmap", "no page for 0x%lx\n", va);
+        return -1;
+    }
+    page->owner = pcb;
+    page->va = va;
+    list_insert(&pcb->page_list, &page->list);
+    fs_read_page(area->ino, area->offset + (va - area->va), (uint8_t *) page->kva);
+
+    set_pfn(pte, kva2pa(page->kva) >> NORMAL_PAGE_SHIFT);
+    // NOTE: dirty bit is clear, the first store faults again and marks it
+    set_attribute(pte, _PAGE_PRESENT | _PAGE_READ | _PAGE_USER | (area->writable ? _PAGE_WRITE : 0));
+    logging(LOG_DEBUG, "mmap", "... load inode %d offset 0x%x to 0x%lx\n",
+            area->ino, area->offset + (va - area->va), va);
+    return 1;
+}
+
+int is_mmap_addr(pcb_t *pcb, uintptr_t va) {
+    return find_area(get_process(pcb)->pid, va) != NULL;
+}
+
+uintptr_t mmap_reclaim(page_t *page, PTE *pte, int fs) {
+    // called by swap_out(), write the page back if dirty and unmap it, it's loaded again on fault
+    // return its frame, or 0 if it has to stay
+    if (get_attribute(*pte, _PAGE_DIRTY)) {
+        mmap_area_t *area = find_area(page->owner->pid, page->va);
+        if (!fs || fs_write_page(area->ino, area->offset + (page->va - area->va), (uint8_t *) page->kva) != 0)
+            return 0;
+    }
+    logging(LOG_DEBUG, "mmap", "reclaim pid=%d, va=0x%lx\n", page->owner->pid, page->va);
+    *pte = 0;
+    list_delete(&page->list);
+    list_delete(&page->onmem);
+    uintptr_t kva = page->kva;
+    put_page_struct(page);
+    return kva;
+}
+
+static int sync_area(pcb_t *pcb, mmap_area_t *area, int unmap) {
+    // write dirty pages back, and drop them if unmap, -1 if some page can't be written
+    int ret = 0;
+    list_node_t *p = pcb->page_list.next;
+    while (p != &pcb->page_list) {
+        page_t *page = list_entry(p, page_t, list);
+        p = p->next;
+        if (page->tp != PAGE_MMAP || page->va < area->va || page->va >= area->va + area->len)
+            continue;
+        PTE *pte = get_pte_of(page->va, pcb->pgdir, 0);
+        if (pte != NULL && get_attribute(*pte, _PAGE_DIRTY)) {
+            if (fs_write_page(area->ino, area->offset + (page->va - area->va), (uint8_t *) page->kva) != 0) {
+                // stays dirty, msync may be retried when there is space
+                logging(LOG_ERROR, "mmap", "no space to write back 0x%lx\n", page->va);
+                ret = -1;
+            } else {
+                set_attribute(pte, get_attribute(*pte, _PAGE_CTRL_MASK) & ~_PAGE_DIRTY);
+                logging(LOG_DEBUG, "mmap", "... write back 0x%lx\n", page->va);
+            }
+        }
+        if (unmap) {
+            if (pte != NULL)
+                *pte = 0;
+            free_page1(page);
+        }
+    }
+    return ret;
+}
+
+static int unmap_area(pcb_t *pcb, mmap_area_t *area) {
+    int ret = sync_area(pcb, area, 1);
+    fs_release_file(area->ino);
+    area->valid = 0;
+    return ret;
+}
+
+int do_munmap(uintptr_t addr) {
+    pcb_t *self = get_process(current_running[get_current_cpu_id()]);
+    mmap_area_t *area = find_area(self->pid, addr);
+    if (area == NULL || area->va != addr) {
+        logging(LOG_ERROR, "mmap", "munmap: no mapping starts at 0x%lx\n", addr);
+        return -1;
+    }
+    logging(LOG_INFO, "mmap", "%d.%s unmap 0x%lx\n", self->pid, self->name, addr);
+    return unmap_area(self, area);
+}
+
+int do_msync(uintptr_t addr) {
+    pcb_t *self = get_process(current_running[get_current_cpu_id()]);
+    mmap_area_t *area = find_area(self->pid, addr);
+    if (area == NULL) {
+        logging(LOG_ERROR, "mmap", "msync: no mapping at 0x%lx\n", addr);
+        return -1;
+    }
+    return sync_area(self, area, 0);
+}
+
+int mmap_fork(pcb_t *dst, pcb_t *src) {
+    // dst maps the same file ranges, -1 and nothing copied if there are not enough areas
+    // dirty pages of src are written back first so that dst loads what src sees
+    int need = 0, avail = 0;
+    for (int i=0; i<MMAP_AREA_NUM; i++) {
+        if (!mmap_areas[i].valid)
+            avail ++;
+        else if (mmap_areas[i].pid == src->pid)
+            need ++;
+    }
+    if (need > avail) {
+        logging(LOG_ERROR, "mmap", "no area available for fork\n");
+        return -1;
+    }
+    for (int i=0, k=0; i<MMAP_AREA_NUM && need>0; i++) {
+        mmap_area_t *area = &mmap_areas[i];
+        if (!area->valid || area->pid != src->pid || area->pid == dst->pid)
+            continue;
+        if (sync_area(src, area, 0) != 0)
+            logging(LOG_WARNING, "mmap", "fork: 0x%lx not written back, child may read old data\n", area->va);
+        while (mmap_areas[k].valid)
+            k ++;
+        mmap_areas[k] = *area;
+        mmap_areas[k].pid = dst->pid;
+        fs_dup_file(area->ino);
+        need --;
+        logging(LOG_INFO, "mmap", "%d.%s inherit 0x%lx\n", dst->pid, dst->name, area->va);
+    }
+    return 0;
+}
+
+void munmap_all(pcb_t *pcb) {
+    // called when a process is killed, its mappings are written back
+    for (int i=0; i<MMAP_AREA_NUM; i++)
+        if (mmap_areas[i].valid && mmap_areas[i].pid == pcb->pid)
+            unmap_area(pcb, &mmap_areas[i]);
+}
@@ -60,20 +60,32 @@ uintptr_t shm_page_get(int key)
         logging(LOG_ERROR, "shm", "maximum references exceeded for shm[%d]\n", idx);
         do_exit();
     }
-    // record key
-    shm_pages[idx].key = key;
     // ensure page frame exists
     if (shm_pages[idx].page == NULL) {
         shm_pages[idx].page = alloc_page1();
+        if (shm_pages[idx].page == NULL) {
+            logging(LOG_ERROR, "shm", "no page for shm[%d]\n", idx);
+            return 0;
+        }
         shm_pages[idx].page->tp = PAGE_SHM;
     }
+    // map page
+    PTE *pte = map_page(va, current_running[cid]->pgdir, NULL, 0);
+    if (pte == NULL) {
+        logging(LOG_ERROR, "shm", "no page table for 0x%lx\n", va);
+        if (shm_pages[idx].ref == 0) {
+            free_page1(shm_pages[idx].page);
+            shm_pages[idx].page = NULL;
+        }
+        return 0;
+    }
+    // record key
+    shm_pages[idx].key = key;
     // record in map
     shm_pages[idx].map[shm_pages[idx].ref].pid = current_running[cid]->pid;
     shm_pages[idx].map[shm_pages[idx].ref].va = va;
     // add ref
     shm_pages[idx].ref ++;
-    // map page
-    PTE *pte = map_page(va, current_running[cid]->pgdir, NULL, 0);
     // set pgtable
     set_pfn(pte, kva2pa(shm_pages[idx].page->kva) >> NORMAL_PAGE_SHIFT);
     set_attribute(pte, _PAGE_PRESENT | _PAGE_READ | _PAGE_WRITE | _PAGE_EXEC | _PAGE_USER);
@@ -125,3 +137,44 @@ void shm_page_dt(uintptr_t addr)
     logging(LOG_INFO, "shm", "%d.%s detach shm[%d]\n",
             current_running[cid]->pid, current_running[cid]->name, idx);
 }
+
+int shm_fork(pcb_t *dst, pcb_t *src) {
+    // dst gets the attachments of src at the same va, -1 and nothing recorded if it can't
+    for (int i=0; i<SHM_PAGE_NUM; i++) {
+        int n = shm_pages[i].ref, need = 0;
+        for (int j=0; j<n; j++) {
+            if (shm_pages[i].map[j].pid != src->pid)
+                continue;
+            if (n + ++need > SHM_PAGE_MAX_REF) {
+                logging(LOG_ERROR, "shm", "maximum references exceeded for shm[%d]\n", i);
+                return -1;
+            }
+            // page tables go to dst's page_list, freed with it if fork fails
+            PTE *pte = map_page(shm_pages[i].map[j].va, dst->pgdir, &dst->page_list, 0);
+            if (pte == NULL) {
+                logging(LOG_ERROR, "shm", "no page table for 0x%lx\n", shm_pages[i].map[j].va);
+                return -1;
+            }
+            set_pfn(pte, kva2pa(shm_pages[i].page->kva) >> NORMAL_PAGE_SHIFT);
+            set_attribute(pte, _PAGE_PRESENT | _PAGE_READ | _PAGE_WRITE | _PAGE_EXEC | _PAGE_USER);
+        }
+    }
+    // all mapped, record them
+    for (int i=0; i<SHM_PAGE_NUM; i++) {
+        int n = shm_pages[i].ref;
+        for (int j=0; j<n; j++) {
+            if (shm_pages[i].map[j].pid != src->pid)
+                continue;
+            shm_pages[i].map[shm_pages[i].ref].pid = dst->pid;
+            shm_pages[i].map[shm_pages[i].ref].va = shm_pages[i].map[j].va;
+            shm_pages[i].ref ++;
+            logging(LOG_INFO, "shm", "%d.%s inherit shm[%d] at 0x%lx\n",
+                    dst->pid, dst->name, i, shm_pages[i].map[j].va);
+        }
+    }
+    return 0;
+}
+
+int is_shm_addr(uintptr_t va) {
+    return va >= SHM_PAGE_BASE && va < SHM_PAGE_LIM;
+}
@@ -0,0 +1,133 @@
+#include <os/list.h>
+#include <os/mm.h>
+#include <printk.h>
+
+/* kmalloc: power-of-two object caches for small sizes, whole pages for the others
+ * every page handed out starts with a header, so kfree() finds it by rounding down
+ */
+#define SLAB_MAGIC  0x51ab
+#define LARGE_MAGIC 0x1a6e
+#define SLAB_MIN_SHIFT 4   // 16B, an object must hold the free link
+#define SLAB_MAX_SHIFT 10  // 1KB, larger ones waste too much of a page
+#define NUM_SLAB_CACHE (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+typedef struct kmem_cache {
+    size_t size;
+    int num;  // objects per slab
+    list_head partial;  // slabs with free objects
+    int empty;  // slabs with no object in use, one is kept
+} kmem_cache_t;
+
+typedef struct slab {
+    int magic;
+    int npage;  // for large allocation
+    kmem_cache_t *cache;
+    void *free;  // free objects, linked through their first word
+    int inuse;
+    list_node_t list;  // in cache->partial when it has free objects
+} slab_t;
+
+#define SLAB_HEADER ROUND(sizeof(slab_t), 16)
+
+static kmem_cache_t kmem_caches[NUM_SLAB_CACHE];
+static int slab_inited = 0;
+
+static void init_slab(void) {
+    for (int i=0; i<NUM_SLAB_CACHE; i++) {
+        kmem_caches[i].size = 1lu << (SLAB_MIN_SHIFT + i);
+        kmem_caches[i].num = (PAGE_SIZE - SLAB_HEADER) / kmem_caches[i].size;
+        kmem_caches[i].empty = 0;
+        list_init(&kmem_caches[i].partial);
+    }
+    slab_inited = 1;
+}
+
+static slab_t *new_slab(kmem_cache_t *cache) {
+    slab_t *slab = (slab_t *) allocPage(1);
+    if (slab == NULL)
+        return NULL;
+    slab->magic = SLAB_MAGIC;
+    slab->npage = 1;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+    // link objects backwards, so that they are handed out in address order
+    for (int i=cache->num-1; i>=0; i--) {
+        void **obj = (void **) ((uintptr_t) slab + SLAB_HEADER + i * cache->size);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+    list_init(&slab->list);
+    list_insert(&cache->partial, &slab->list);
+    cache->empty ++;
+    logging(LOG_VERBOSE, "slab", "new slab of %dB at 0x%lx\n", cache->size, (uintptr_t) slab);
+    return slab;
+}
+
+static void *slab_alloc(kmem_cache_t *cache) {
+    if (list_is_empty(&cache->partial) && new_slab(cache) == NULL)
+        return NULL;
+    slab_t *slab = list_entry(cache->partial.next, slab_t, list);
+    void **obj = (void **) slab->free;
+    slab->free = *obj;
+    if (slab->inuse ++ == 0)
+        cache->empty --;
+    if (slab->free == NULL)
+        list_delete(&slab->list);
+    return (void *) obj;
+}
+
+static void slab_free(slab_t *slab, void *ptr) {
+    kmem_cache_t *cache = slab->cache;
+    if (slab->free == NULL)
+        list_insert(&cache->partial, &slab->list);
+    *(void **) ptr = slab->free;
+    slab->free = ptr;
+    if (-- slab->inuse != 0)
+        return ;
+    // keep one empty slab for the next allocation, give the others back
+    if (cache->empty ++ > 0) {
+        list_delete(&slab->list);
+        cache->empty --;
+        freePage((ptr_t) slab, 1);
+    }
+}
+
+void *kmalloc(size_t size) {
+    if (!slab_inited)
+        init_slab();
+    if (size == 0)
+        return NULL;
+    int shift = SLAB_MIN_SHIFT;
+    while ((1lu << shift) < size)
+        shift ++;
+    if (shift <= SLAB_MAX_SHIFT) {
+        void *ret = slab_alloc(&kmem_caches[shift - SLAB_MIN_SHIFT]);
+        if (ret == NULL)
+            logging(LOG_ERROR, "slab", "unable to kmalloc %dB\n", size);
+        return ret;
+    }
+    // large allocation, the header takes the beginning of the first page
+    int npage = (SLAB_HEADER + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    slab_t *slab = (slab_t *) allocPage(npage);
+    if (slab == NULL) {
+        logging(LOG_ERROR, "slab", "unable to kmalloc %dB\n", size);
+        return NULL;
+    }
+    slab->magic = LARGE_MAGIC;
+    slab->npage = npage;
+    slab->cache = NULL;
+    return (void *) ((uintptr_t) slab + SLAB_HEADER);
+}
+
+void kfree(void *ptr) {
+    if (ptr == NULL)
+        return ;
+    slab_t *slab = (slab_t *) ROUNDDOWN(ptr, PAGE_SIZE);
+    if (slab->magic == SLAB_MAGIC)
+        slab_free(slab, ptr);
+    else if (slab->magic == LARGE_MAGIC)
+        freePage((ptr_t) slab, slab->npage);
+    else
+        logging(LOG_ERROR, "slab", "kfree 0x%lx which is not from kmalloc\n", (uintptr_t) ptr);
+}
@@ -23,6 +23,10 @@ uint64_t do_snapshot(uint64_t va) {
     }
     // map pagedir for new va
     PTE *new_pte = map_page(new_va, current_running[cid]->pgdir, &current_running[cid]->page_list, 0);
+    if (new_pte == NULL) {
+        logging(LOG_ERROR, "snapshot", "no page table for 0x%lx\n", new_va);
+        return 0;
+    }
     // set attr for new pte
     set_pfn(new_pte, get_pfn(*pte));
     set_attribute(new_pte, _PAGE_PRESENT | _PAGE_READ | _PAGE_WRITE | _PAGE_EXEC | _PAGE_USER);
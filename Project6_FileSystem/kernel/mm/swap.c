@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <os/blk.h>
 #include <os/fs.h>
 #include <os/kernel.h>
 #include <os/mm.h>
@@ -7,83 +8,275 @@
 #include <printk.h>
 
 #define SECTOR_SIZE 512
-LIST_HEAD(freeswap_list);
-
-unsigned int allocDBlock(int numBlock)
-{
-    static unsigned int diskptr = 0;  // block id
-    if (diskptr == 0)
-        diskptr = (*((long *) TASK_INFO_P_LOC) + (appnum + batchnum) * sizeof(task_info_t)) / SECTOR_SIZE + 1;
-    else if (diskptr >= FS_START) {
-        logging(LOG_CRITICAL, "swap", "no swap space avaliable\n");
-        assert(0);
+#define SLOT_SECT (PAGE_SIZE / SECTOR_SIZE)
+#define SWAP_SLOT_MAX (FS_START / SLOT_SECT)
+
+/* swap area: page-sized slots from the end of image to FS_START
+ * a bit is set when the slot is used, allocated next-fit in contiguous clusters
+ */
+static uint64_t swap_map[SWAP_SLOT_MAX / 64];
+static unsigned int swap_start = 0;  // sector of slot 0
+static int swap_slots = 0;
+static int swap_hint = 0;
+
+static void init_swap_slots(void) {
+    // NOTE: task info must be loaded
+    swap_start = (*((long *) TASK_INFO_P_LOC) + (appnum + batchnum) * sizeof(task_info_t)) / SECTOR_SIZE + 1;
+    swap_slots = (FS_START - swap_start) / SLOT_SECT;
+    logging(LOG_INFO, "swap", "%d slots from sector 0x%x\n", swap_slots, swap_start);
+}
+
+static int slot_used(int idx) {
+    return (swap_map[idx / 64] >> (idx % 64)) & 1;
+}
+
+static int alloc_slots(int num) {
+    // next fit, num contiguous slots, return the first one or -1
+    if (swap_slots == 0)
+        init_swap_slots();
+    for (int pass=0; pass<2; pass++) {
+        int run = 0;
+        for (int i=pass ? 0 : swap_hint; i<swap_slots; i++) {
+            run = slot_used(i) ? 0 : run + 1;
+            if (run < num)
+                continue;
+            for (int j=i-num+1; j<=i; j++)
+                swap_map[j / 64] |= 1lu << (j % 64);
+            swap_hint = i + 1;
+            return i - num + 1;
+        }
     }
-    // align PAGE_SIZE
-    unsigned int ret = diskptr;
-    diskptr = ret + numBlock;
-    return ret;
+    return -1;
+}
+
+static void free_slot(int slot) {
+    swap_map[slot / 64] &= ~(1lu << (slot % 64));
 }
 
-swap_t *alloc_swap1(void) {
-    swap_t *swap;
-    if (!list_is_empty(&freeswap_list)) {
-        swap = list_entry(freeswap_list.next, swap_t, list);
-        list_delete(freeswap_list.next);
-        logging(LOG_VERBOSE, "swap", "reuse sector at 0x%x\n", swap->pa);
-    } else {
-        swap = (swap_t *) kmalloc(sizeof(swap_t));
-        list_init(&swap->list);
-        swap->pa = allocDBlock(PAGE_SIZE / SECTOR_SIZE);
-        logging(LOG_VERBOSE, "swap", "allocate new sector at 0x%x\n", swap->pa);
+static swap_t *alloc_swap1(int slot) {
+    // NULL if there's no memory for it, the slot is given back
+    swap_t *swap = (swap_t *) kmalloc(sizeof(swap_t));
+    if (swap == NULL) {
+        logging(LOG_ERROR, "swap", "no memory for swap record\n");
+        free_slot(slot);
+        return NULL;
     }
+    swap->pa = swap_start + slot * SLOT_SECT;
+    logging(LOG_VERBOSE, "swap", "allocate sector at 0x%x\n", swap->pa);
     return swap;
 }
 
 void free_swap1(swap_t *swap) {
-    list_insert(&freeswap_list, &swap->list);
+    free_slot((swap->pa - swap_start) / SLOT_SECT);
     logging(LOG_VERBOSE, "swap", "freed sector at 0x%x\n", swap->pa);
+    kfree(swap);
 }
 
-// FIFO swap
-uintptr_t swap_out() {
-    logging(LOG_INFO, "swap", "store page to disk\n");
-    page_t *page = list_entry(onmem_list.next, page_t, onmem);
-    // alloc swap sector
-    page->swap = alloc_swap1();
-    // delete from onmem
-    list_delete(onmem_list.next);
-    logging(LOG_DEBUG, "swap", "... from 0x%lx\n", page->kva);
-    // set pfn & attr
-    PTE *pte = get_pte_of(page->va, page->owner->pgdir, 0);
+static int alloc_swap_cluster(page_t **pages, int num) {
+    // contiguous slots for pages, so that they are written with one request
+    // -1 and nothing allocated if the records can't be
+    int first = alloc_slots(num);
+    for (int i=0; i<num; i++) {
+        int slot = first != -1 ? first + i : alloc_slots(1);
+        if (slot == -1) {
+            logging(LOG_CRITICAL, "swap", "no swap space avaliable\n");
+            assert(0);
+        }
+        pages[i]->swap = alloc_swap1(slot);
+        if (pages[i]->swap == NULL) {
+            for (int j=i+1; first!=-1 && j<num; j++)
+                free_slot(first + j);
+            for (int j=0; j<i; j++) {
+                free_swap1(pages[j]->swap);
+                pages[j]->swap = NULL;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static uintptr_t swap_drop(page_t *page, PTE *pte) {
+    // unmap a user page, its content must be on disk by now
+    list_delete(&page->onmem);
     set_attribute(pte, get_attribute(*pte, _PAGE_CTRL_MASK) & ~_PAGE_PRESENT);
-    // store to disk
-    bios_sdwrite(kva2pa(page->kva), PAGE_SIZE/SECTOR_SIZE, page->swap->pa);
     logging(LOG_DEBUG, "swap", "... pid=%d, va=0x%lx, diskptr=0x%x\n", page->owner->pid, page->va, page->swap->pa);
-    // reset kva
     uintptr_t kva = page->kva;
     page->kva = 0;
     return kva;
 }
 
-void swap_in(page_t *page, uintptr_t kva) {
-    logging(LOG_INFO, "swap", "load page from disk\n");
-    logging(LOG_DEBUG, "swap", "... to 0x%lx\n", kva);
-    // reset kva
+static int swap_write(page_t **pages, PTE **ptes, uintptr_t *frames, int num) {
+    // store a cluster of dirty pages to disk, request queue merges them into one transfer
+    // return the number of frames freed, 0 if they can't be written
+    // NOTE: frames are reused right after, can't leave them in the queue
+    blk_req_t reqs[SWAP_CLUSTER];
+    logging(LOG_INFO, "swap", "store %d pages to disk\n", num);
+    for (int i=0; i<num; i++) {
+        // a stale copy is dropped, the cluster is allocated together
+        if (pages[i]->swap != NULL) {
+            free_swap1(pages[i]->swap);
+            pages[i]->swap = NULL;
+        }
+    }
+    if (alloc_swap_cluster(pages, num) != 0)
+        return 0;
+    for (int i=0; i<num; i++) {
+        reqs[i].dir = BLK_WRITE;
+        reqs[i].sector = pages[i]->swap->pa;
+        reqs[i].nsect = SLOT_SECT;
+        reqs[i].kva = pages[i]->kva;
+        reqs[i].done = NULL;
+        list_init(&reqs[i].list);
+        blk_submit(&reqs[i]);
+    }
+    for (int i=0; i<num; i++) {
+        blk_wait(&reqs[i]);
+        frames[i] = swap_drop(pages[i], ptes[i]);
+    }
+    return num;
+}
+
+static void swap_rotate(page_t *page) {
+    // pass the clock hand, i.e. move to the tail of onmem_list
+    list_delete(&page->onmem);
+    list_insert(onmem_list.prev, &page->onmem);
+}
+
+// CLOCK (second chance) swap
+/* user pages, mapped file pages and cached blocks are in the same onmem_list, the hand is its head:
+ * - a user page with accessed bit gets a second chance, the bit is cleared and it goes to the tail
+ * - a clean cached block is simply dropped
+ * - a mapped page is written back to its file if dirty and dropped, only if fs is allowed for a dirty one
+ * - a user page whose swap copy is up to date is dropped without writing
+ * - if none of above, SWAP_CLUSTER not accessed dirty pages are written together
+ * one frame is returned, the others go back to the free frames
+ */
+uintptr_t swap_out(int fs) {
+    uintptr_t frames[SWAP_CLUSTER];
+    int nframe = 0;
+    for (int pass=0; pass<2 && nframe==0; pass++) {
+        int num = 0;
+        for (list_node_t *p=onmem_list.next; p!=&onmem_list; p=p->next)
+            num ++;
+        // two rounds at most, accessed bits are all cleared after the first
+        page_t *dirty[SWAP_CLUSTER];
+        PTE *dirty_pte[SWAP_CLUSTER];
+        int ndirty = 0;
+        for (int i=0; i<2*num && nframe<SWAP_CLUSTER && !list_is_empty(&onmem_list); i++) {
+            page_t *page = list_entry(onmem_list.next, page_t, onmem);
+            if (page->tp == PAGE_CACHE) {
+                if (bcache_reclaim(page)) {
+                    logging(LOG_DEBUG, "swap", "reclaim cached block at 0x%lx\n", page->kva);
+                    list_delete(&page->onmem);
+                    frames[nframe++] = page->kva;
+                    put_page_struct(page);
+                } else
+                    swap_rotate(page);
+                continue;
+            }
+            if (frame_shared(page->kva)) {
+                // used by another process through fork
+                swap_rotate(page);
+                continue;
+            }
+            PTE *pte = get_pte_of(page->va, page->owner->pgdir, 0);
+            if (get_attribute(*pte, _PAGE_ACCESSED)) {
+                // NOTE: tlb is flushed in interrupt_helper() before returning to user
+                set_attribute(pte, get_attribute(*pte, _PAGE_CTRL_MASK) & ~_PAGE_ACCESSED);
+                swap_rotate(page);
+                continue;
+            }
+            if (page->tp == PAGE_MMAP) {
+                int dirty_page = get_attribute(*pte, _PAGE_DIRTY);
+                uintptr_t kva = mmap_reclaim(page, pte, fs);
+                if (kva != 0)
+                    frames[nframe++] = kva;
+                else
+                    swap_rotate(page);
+                // writing back may have swapped out pages collected so far
+                if (dirty_page && fs)
+                    ndirty = 0;
+                continue;
+            }
+            if (page->swap != NULL && !get_attribute(*pte, _PAGE_DIRTY)) {
+                // swap copy is still up to date
+                logging(LOG_INFO, "swap", "drop clean page\n");
+                frames[nframe++] = swap_drop(page, pte);
+                continue;
+            }
+            if (ndirty < SWAP_CLUSTER) {
+                dirty[ndirty] = page;
+                dirty_pte[ndirty] = pte;
+                ndirty ++;
+            }
+            swap_rotate(page);
+        }
+        if (nframe == 0 && ndirty != 0) {
+            nframe = swap_write(dirty, dirty_pte, frames, ndirty);
+        }
+        if (nframe == 0) {
+            // only dirty or busy blocks left, finish the reads and try again
+            // NOTE: dirty blocks are not committed here, we may be in the middle of an fs operation
+            blk_drain();
+        }
+    }
+    if (nframe == 0) {
+        logging(LOG_CRITICAL, "swap", "no page can be reclaimed\n");
+        return 0;
+    }
+    for (int i=1; i<nframe; i++)
+        put_frame(frames[i]);
+    return frames[0];
+}
+
+static void swap_map_page(page_t *page, uintptr_t kva) {
+    // NOTE: swap sector is kept, the page can be dropped again without writing until it's dirty
     page->kva = kva;
-    // load from disk
-    bios_sdread(kva2pa(kva), PAGE_SIZE/SECTOR_SIZE, page->swap->pa);
-    logging(LOG_DEBUG, "swap", "... pid=%d, va=0x%lx, diskptr=0x%x\n", page->owner->pid, page->va, page->swap->pa);
-    // free swap sector
-    free_swap1(page->swap);
-    page->swap = NULL;
     // set pfn & attr
     PTE *pte = get_pte_of(page->va, page->owner->pgdir, 4);
     set_pfn(pte, kva2pa(kva) >> NORMAL_PAGE_SHIFT);
-    set_attribute(pte, get_attribute(*pte, _PAGE_CTRL_MASK) | _PAGE_PRESENT);
+    set_attribute(pte, (get_attribute(*pte, _PAGE_CTRL_MASK) | _PAGE_PRESENT) & ~_PAGE_DIRTY);
     // insert into onmem
     list_insert(onmem_list.prev, &page->onmem);
 }
 
+void swap_in(page_t *page, uintptr_t kva) {
+    // load page from disk, with pages in the following slots of the same process (swap readahead)
+    // NOTE: readahead only takes free frames, its pages are not accessed and go first if unused
+    page_t *pages[SWAP_CLUSTER];
+    uintptr_t kvas[SWAP_CLUSTER];
+    blk_req_t reqs[SWAP_CLUSTER];
+    int num = 1;
+    pages[0] = page;
+    kvas[0] = kva;
+    list_head *page_list = get_page_list(page->owner);
+    for (list_node_t *p=page_list->next; p!=page_list && num<SWAP_CLUSTER; p=p->next) {
+        page_t *tmp = list_entry(p, page_t, list);
+        if (tmp->kva != 0 || tmp->swap == NULL || tmp->swap->pa <= page->swap->pa ||
+            tmp->swap->pa >= page->swap->pa + SWAP_CLUSTER * SLOT_SECT)
+            continue;
+        if ((kvas[num] = get_frame(0)) == 0)
+            break;
+        pages[num++] = tmp;
+    }
+    logging(LOG_INFO, "swap", "load %d pages from disk\n", num);
+    for (int i=0; i<num; i++) {
+        reqs[i].dir = BLK_READ;
+        reqs[i].sector = pages[i]->swap->pa;
+        reqs[i].nsect = SLOT_SECT;
+        reqs[i].kva = kvas[i];
+        reqs[i].done = NULL;
+        list_init(&reqs[i].list);
+        blk_submit(&reqs[i]);
+    }
+    for (int i=0; i<num; i++) {
+        blk_wait(&reqs[i]);
+        logging(LOG_DEBUG, "swap", "... pid=%d, va=0x%lx, diskptr=0x%x\n", pages[i]->owner->pid, pages[i]->va, pages[i]->swap->pa);
+        swap_map_page(pages[i], kvas[i]);
+    }
+}
+
 page_t *check_and_swap(pcb_t *pcb, uintptr_t va) {
     if (pcb->type == TYPE_THREAD)
         pcb = get_parent(pcb->pid);
@@ -92,13 +285,15 @@ page_t *check_and_swap(pcb_t *pcb, uintptr_t va) {
         if (page->va != (va & ~(PAGE_SIZE-1))) {
             continue;
         }
-        if (page->swap == NULL) {
+        if (page->kva != 0) {
             if (page->tp != PAGE_USER)
                 continue;
             logging(LOG_ERROR, "swap", "page record found, but not on disk, kva=0x%lx\n", page->kva);
             return NULL;
         }
-        uintptr_t kva = swap_out();
+        uintptr_t kva = get_frame(1);
+        if (kva == 0)
+            return NULL;
         swap_in(page, kva);
         return page;
     }
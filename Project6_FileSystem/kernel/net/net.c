@@ -10,6 +10,8 @@
 static LIST_HEAD(send_block_queue);
 static LIST_HEAD(recv_block_queue);
 
+spin_lock_t net_lock;
+
 int do_net_send(void *txpacket, int length) {
     // Transmit one network packet via e1000 device
     int cid = get_current_cpu_id();
@@ -8,8 +8,7 @@
 #include <os/pthread.h>
 #include <printk.h>
 
-extern void ret_from_exception();
-extern void pcb_enqueue(list_node_t *queue, pcb_t *pcb);
+extern void ret_from_fork();
 
 pcb_t *get_parent(pid_t pid) {
     for (int i=0; i<NUM_MAX_TASK; i++) {
@@ -43,7 +42,7 @@ static void init_tcb_stack(ptr_t kernel_stack, ptr_t entry_point, void *arg, pcb
     tcb->kernel_sp = (reg_t) pt_switchto;
 
     // save regs to kernel_stack
-    pt_switchto->regs[0] = (reg_t) ret_from_exception;
+    pt_switchto->regs[0] = (reg_t) ret_from_fork;
     for (int i=1; i<14; i++)
         pt_switchto->regs[i] = 0;
 }
@@ -72,6 +71,10 @@ pid_t pthread_create(uint64_t entrypoint, void *arg) {
 
     // allocate a new page for kernel stack, set user stack
     page_t *tmp = alloc_page1();
+    if (tmp == NULL) {
+        put_pcb_idx(idx);
+        return 0;
+    }
     list_insert(&parent->page_list, &tmp->list);
     pcb[idx].kernel_sp = pcb[idx].kernel_stack_base = tmp->kva + PAGE_SIZE;
     pcb[idx].user_sp = pcb[idx].user_stack_base = USER_STACK_ADDR + (parent->tid + 1) * PAGE_SIZE * 16;
@@ -82,8 +85,8 @@ pid_t pthread_create(uint64_t entrypoint, void *arg) {
     pcb[idx].type = TYPE_THREAD;
     strcpy(pcb[idx].name, parent->name);
 
-    // cpu
-    pcb[idx].cid = 0;
+    // cpu, start on this hart
+    pcb[idx].cid = cid;
     pcb[idx].mask = current_running[cid]->mask;
 
     // screen
@@ -91,13 +94,20 @@ pid_t pthread_create(uint64_t entrypoint, void *arg) {
 
     // status
     pcb[idx].status = TASK_READY;
+    pcb[idx].lock = NULL;
+
+    // priority, vruntime is set by ready_enqueue()
+    pcb[idx].nice = current_running[cid]->nice;
+    pcb[idx].vruntime = 0;
 
     logging(LOG_INFO, "scheduler", "create %s as tid=%d\n", pcb[idx].name, pcb[idx].tid);
 
     init_tcb_stack(pcb[idx].kernel_sp, entrypoint, arg, &pcb[idx]);
 
     list_init(&pcb[idx].wait_list);
-    pcb_enqueue(&ready_queue, &pcb[idx]);
+    spin_lock_acquire(&sched_lock);
+    ready_enqueue(&pcb[idx]);
+    spin_lock_release(&sched_lock);
     return pcb[idx].tid;
 }
 
@@ -130,9 +140,11 @@ void pthread_exit() {
     do_mutex_lock_release_f(current_running[cid]->pid, current_running[cid]->tid);
     // barrier & mbox will not be released by kernel
     // do kill
+    spin_lock_acquire(&sched_lock);
     current_running[cid]->status = TASK_EXITED;
     // remove pcb from any queue, this will do nothing if pcb is not in a queue
     list_delete(&current_running[cid]->list);
+    spin_lock_release(&sched_lock);
     // log
     logging(LOG_INFO, "scheduler", "thread %d.%s.%d exited\n", current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid);
     // never returns
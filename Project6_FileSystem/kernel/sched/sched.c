@@ -7,8 +7,10 @@
 #include <os/string.h>
 #include <os/task.h>
 #include <os/time.h>
+#include <os/kernel.h>
 #include <os/mm.h>
 #include <os/net.h>
+#include <os/pthread.h>
 #include <screen.h>
 #include <printk.h>
 #include <assert.h>
@@ -24,8 +26,9 @@ pcb_t pid0_pcb[2];
 // last allocated pid
 int pid_n = 0;
 
-LIST_HEAD(ready_queue);
-LIST_HEAD(sleep_queue);
+list_head ready_queue[NR_CPUS];
+
+spin_lock_t sched_lock;
 
 /* current running task PCB */
 pcb_t * volatile current_running[2];
@@ -33,12 +36,16 @@ pcb_t * volatile current_running[2];
 /* global process id */
 pid_t process_id = 1;
 
-extern void ret_from_exception();
+extern void ret_from_fork();
 extern void init_shell();
 
 void init_pcbs(void) {
-    for (int i=0; i<NUM_MAX_TASK; i++)
+    for (int i=0; i<NUM_MAX_TASK; i++) {
         pcb[i].status = TASK_UNUSED;
+        pcb[i].collected = 0;
+    }
+    for (int i=0; i<NR_CPUS; i++)
+        list_init(&ready_queue[i]);
 }
 
 static void init_pcb_stack(
@@ -104,7 +111,7 @@ static void init_pcb_stack(
     logging(LOG_DEBUG, "scheduler", "... kernel_sp=0x%lx, user_sp=0x%lx\n", pcb->kernel_sp, pcb->user_sp);
 
     // save regs to kernel_stack
-    pt_switchto->regs[0] = (reg_t) ret_from_exception;
+    pt_switchto->regs[0] = (reg_t) ret_from_fork;
     for (int i=1; i<14; i++)
         pt_switchto->regs[i] = 0;
 }
@@ -124,14 +131,129 @@ pcb_t *pcb_dequeue(list_node_t *queue, unsigned cid) {
     return NULL;
 }
 
+#ifdef SCHED_FAIR
+#define NICE_0_WEIGHT 1024
+// cpu time a waking task may be ahead of the others, so that it runs soon but can't hog the hart
+#define SCHED_WAKEUP_CREDIT TIMER_INTERVAL
+
+// from linux, each nice level is ~10% cpu time
+static const int nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+};
+
+// smallest vruntime that has run on each hart, harts don't share the clock
+static uint64_t min_vruntime[NR_CPUS];
+
+static void update_vruntime(pcb_t *pcb, uint64_t now) {
+    pcb->vruntime += (now - pcb->exec_start) * NICE_0_WEIGHT / nice_to_weight[pcb->nice - NICE_MIN];
+    pcb->exec_start = now;
+}
+
+static void migrate_vruntime(pcb_t *pcb, int from, int to) {
+    // keep its distance to min_vruntime
+    int64_t lag = (int64_t) (pcb->vruntime - min_vruntime[from]);
+    if (lag < 0 && (uint64_t) -lag > min_vruntime[to])
+        pcb->vruntime = 0;
+    else
+        pcb->vruntime = min_vruntime[to] + lag;
+}
+#endif
+
+static void kick_idle_harts(pcb_t *pcb) {
+    // idle harts have no tick, send an ipi to those the task may run on, they take it in do_scheduler()
+    int self = get_current_cpu_id();
+    for (int i=0; i<NR_CPUS; i++) {
+        if (i != self && (pcb->mask & (1 << i)) && current_running[i] == &pid0_pcb[i]) {
+            unsigned long hart_mask = 1lu << i;
+            send_ipi(&hart_mask);
+        }
+    }
+}
+
+void ready_enqueue(pcb_t *pcb) {
+    // called with sched_lock held
+    // stay on the hart it ran last if the mask allows, or go to the first hart allowed
+    int cid = pcb->cid;
+    if (!(pcb->mask & (1 << cid))) {
+        for (cid=0; cid<NR_CPUS-1 && !(pcb->mask & (1 << cid)); cid++)
+            ;
+    }
+    if (!(pcb->mask & (1 << cid)))
+        logging(LOG_WARNING, "scheduler", "%d.%s.%d mask=0x%x allows no hart\n", pcb->pid, pcb->name, pcb->tid, pcb->mask);
+#ifdef SCHED_FAIR
+    if (cid != pcb->cid)
+        migrate_vruntime(pcb, pcb->cid, cid);
+    // its vruntime is relative to this hart now, don't migrate it again from the old one
+    pcb->cid = cid;
+    // a task slept for long doesn't get all that time back
+    if (pcb->vruntime + SCHED_WAKEUP_CREDIT < min_vruntime[cid])
+        pcb->vruntime = min_vruntime[cid] - SCHED_WAKEUP_CREDIT;
+    // sorted by vruntime, FIFO for the same
+    list_node_t *p = ready_queue[cid].next;
+    while (p != &ready_queue[cid] && list_entry(p, pcb_t, list)->vruntime <= pcb->vruntime)
+        p = p->next;
+    list_insert(p->prev, &pcb->list);
+#else
+    pcb_enqueue(&ready_queue[cid], pcb);
+#endif
+    // current_running is put back by schedule(), no one else has to run it
+    if (pcb != current_running[get_current_cpu_id()])
+        kick_idle_harts(pcb);
+}
+
+static void set_next_timer(int cid, pcb_t *next, uint64_t now) {
+    // tickless: the earliest sleeper, or the end of the time slice
+    // an idle hart has no slice, except hart 0 which wakes up every second for bcache flush and blk queue
+    uint64_t tick = (uint64_t) -1;
+    if (next->pid != 0)
+        tick = now + TIMER_INTERVAL;
+    else if (cid == 0)
+        tick = now + time_base;
+    uint64_t deadline = next_wakeup();
+    bios_set_timer(deadline < tick ? deadline : tick);
+}
+
+static pcb_t *pick_next(int cid) {
+    // own queue first, an idle hart steals the first task allowed on it from the others
+    pcb_t *next = pcb_dequeue(&ready_queue[cid], 1 << cid);
+    for (int i=1; i<NR_CPUS && next == NULL; i++) {
+        int victim = (cid + i) % NR_CPUS;
+        next = pcb_dequeue(&ready_queue[victim], 1 << cid);
+        if (next != NULL) {
+            logging(LOG_VV, "scheduler", "hart %d steals %d.%s.%d\n", cid, next->pid, next->name, next->tid);
+#ifdef SCHED_FAIR
+            migrate_vruntime(next, victim, cid);
+#endif
+        }
+    }
+    return next;
+}
+
 int new_pcb_idx() {
+    // an exited slot may still run on the other hart or hold its pages until collected
     for (int i=0; i<NUM_MAX_TASK; i++) {
-        if (pcb[i].status == TASK_UNUSED || pcb[i].status == TASK_EXITED)
+        if (pcb[i].status == TASK_UNUSED || (pcb[i].status == TASK_EXITED && pcb[i].collected)) {
+            pcb[i].collected = 0;
             return i;
+        }
     }
     return -1;
 }
 
+void put_pcb_idx(int idx) {
+    // a task failed to be created, its pages go back and the slot can be taken again
+    while (!list_is_empty(&pcb[idx].page_list))
+        free_page1(list_entry(pcb[idx].page_list.next, page_t, list));
+    pcb[idx].collected = 1;
+}
+
 #ifdef S_CORE_P3
 pid_t do_exec(int id, int argc, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
     int cid = get_current_cpu_id();
@@ -164,6 +286,8 @@ pid_t do_exec(char *name, int argc, char *argv[]) {
 
     // allocate a new pgdir and copy from kernel
     page_t *tmp = alloc_page1();
+    if (tmp == NULL)
+        goto nomem;
     list_insert(&pcb[idx].page_list, &tmp->list);
     pcb[idx].pgdir = tmp->kva;
     share_pgtable(pcb[idx].pgdir, pid0_pcb[cid].pgdir);
@@ -172,6 +296,8 @@ pid_t do_exec(char *name, int argc, char *argv[]) {
     // if S_CORE, alloc a large page
 #ifdef S_CORE
     uintptr_t page = alloc_page_helper(apps[id].entrypoint, &pcb[idx]);
+    if (page == 0)
+        goto nomem;
     load_img(page, apps[id].phyaddr, apps[id].size);
 #else
     // else, alloc normal pages
@@ -180,6 +306,8 @@ pid_t do_exec(char *name, int argc, char *argv[]) {
     uint64_t end = apps[id].size+apps[id].entrypoint;
     for (; va < end; va += PAGE_SIZE, pa += PAGE_SIZE) {
         uintptr_t page = alloc_page_helper(va, &pcb[idx]);
+        if (page == 0)
+            goto nomem;
         uint64_t size = end-va < PAGE_SIZE ? end-va : PAGE_SIZE;
         load_img(page, pa, size);
     }
@@ -187,12 +315,17 @@ pid_t do_exec(char *name, int argc, char *argv[]) {
 
     // allocate a new page for kernel stack, set user stack
     tmp = alloc_page1();
+    if (tmp == NULL)
+        goto nomem;
     list_insert(&pcb[idx].page_list, &tmp->list);
     pcb[idx].kernel_sp = pcb[idx].kernel_stack_base = tmp->kva + PAGE_SIZE;
 #ifdef S_CORE
     uintptr_t user_stack_kva = page + USER_STACK_ADDR - apps[id].entrypoint;
 #else
-    uintptr_t user_stack_kva = alloc_page_helper(USER_STACK_ADDR - PAGE_SIZE, &pcb[idx]) + PAGE_SIZE;
+    uintptr_t user_stack_kva = alloc_page_helper(USER_STACK_ADDR - PAGE_SIZE, &pcb[idx]);
+    if (user_stack_kva == 0)
+        goto nomem;
+    user_stack_kva += PAGE_SIZE;
 #endif
     pcb[idx].user_sp = pcb[idx].user_stack_base = USER_STACK_ADDR;
 
@@ -202,15 +335,24 @@ pid_t do_exec(char *name, int argc, char *argv[]) {
     pcb[idx].type = TYPE_PROCESS;
     strcpy(pcb[idx].name, apps[id].name);
 
-    // cpu
-    pcb[idx].cid = 0;
+    // cpu, start on this hart
+    pcb[idx].cid = cid;
     pcb[idx].mask = current_running[cid]->mask;
 
     // screen
     pcb[idx].cursor_x = pcb[idx].cursor_y = 0;
 
+    // files
+    for (int i=0; i<NUM_FDESCS; i++)
+        pcb[idx].fdtable[i] = NULL;
+
     // status
     pcb[idx].status = TASK_READY;
+    pcb[idx].lock = NULL;
+
+    // priority, vruntime is set by ready_enqueue()
+    pcb[idx].nice = 0;
+    pcb[idx].vruntime = 0;
 
     logging(LOG_INFO, "scheduler", "loaded %s as pid=%d\n", pcb[idx].name, pcb[idx].pid);
     logging(LOG_DEBUG, "scheduler", "... pgdir=0x%lx\n", pcb[idx].pgdir);
@@ -226,11 +368,118 @@ pid_t do_exec(char *name, int argc, char *argv[]) {
     );
 
     list_init(&pcb[idx].wait_list);
-    pcb_enqueue(&ready_queue, &pcb[idx]);
+    spin_lock_acquire(&sched_lock);
+    ready_enqueue(&pcb[idx]);
+    spin_lock_release(&sched_lock);
     return pcb[idx].pid;
+
+nomem:
+    logging(LOG_ERROR, "scheduler", "exec %s: out of memory\n", apps[id].name);
+    put_pcb_idx(idx);
+    return 0;
 }
 
-void do_scheduler(void) {
+pid_t do_fork(void) {
+    int cid = get_current_cpu_id();
+    pcb_t *self = current_running[cid];
+    logging(LOG_INFO, "scheduler", "%d.%s.%d fork\n", self->pid, self->name, self->tid);
+
+    do_garbage_collector();
+
+    // get new idx
+    int idx = new_pcb_idx();
+    if (idx < 0 || idx >= NUM_MAX_TASK) {
+        logging(LOG_ERROR, "scheduler", "max task num exceeded\n");
+        return -1;
+    }
+    // a thread forks its whole process
+    pcb_t *parent = self->type == TYPE_PROCESS ? self : get_parent(self->pid);
+
+    // init page_list
+    list_init(&pcb[idx].page_list);
+
+    // allocate a new pgdir and copy from kernel
+    page_t *tmp = alloc_page1();
+    if (tmp == NULL)
+        goto nomem;
+    list_insert(&pcb[idx].page_list, &tmp->list);
+    pcb[idx].pgdir = tmp->kva;
+    share_pgtable(pcb[idx].pgdir, pid0_pcb[cid].pgdir);
+
+    // user pages are shared and copied on write
+    if (copy_user_pages(&pcb[idx], parent) != 0)
+        goto nomem;
+
+    // allocate a new page for kernel stack, the child returns from this syscall with 0
+    tmp = alloc_page1();
+    if (tmp == NULL)
+        goto nomem;
+    list_insert(&pcb[idx].page_list, &tmp->list);
+    pcb[idx].kernel_stack_base = tmp->kva + PAGE_SIZE;
+    regs_context_t *pt_regs =
+        (regs_context_t *)(pcb[idx].kernel_stack_base - sizeof(regs_context_t));
+    memcpy((uint8_t *) pt_regs, (uint8_t *) (self->kernel_stack_base - sizeof(regs_context_t)),
+           sizeof(regs_context_t));
+    pt_regs->regs[10] = 0;
+    switchto_context_t *pt_switchto =
+        (switchto_context_t *)((ptr_t)pt_regs - sizeof(switchto_context_t));
+    pt_switchto->regs[0] = (reg_t) ret_from_fork;
+    for (int i=1; i<14; i++)
+        pt_switchto->regs[i] = 0;
+    pcb[idx].kernel_sp = (reg_t) pt_switchto;
+    pcb[idx].user_sp = pt_regs->regs[2];
+    pcb[idx].user_stack_base = self->user_stack_base;
+
+    // identifier, tid keeps counting so that new threads don't reuse copied stacks
+    pcb[idx].pid = ++pid_n;
+    pcb[idx].tid = parent->tid;
+    pcb[idx].type = TYPE_PROCESS;
+    strcpy(pcb[idx].name, parent->name);
+
+    // cpu, start on this hart
+    pcb[idx].cid = cid;
+    pcb[idx].mask = self->mask;
+
+    // mmap areas and shm attachments, fork fails before anything else is shared
+    if (mmap_fork(&pcb[idx], parent) != 0)
+        goto nomem;
+    if (shm_fork(&pcb[idx], parent) != 0) {
+        munmap_all(&pcb[idx]);
+        goto nomem;
+    }
+
+    // screen
+    pcb[idx].cursor_x = self->cursor_x;
+    pcb[idx].cursor_y = self->cursor_y;
+
+    // files
+    dup_all_files(pcb[idx].fdtable, parent->fdtable);
+
+    // status
+    pcb[idx].status = TASK_READY;
+    pcb[idx].lock = NULL;
+
+    // priority, the child starts with the parent's vruntime
+    pcb[idx].nice = self->nice;
+    pcb[idx].vruntime = self->vruntime;
+
+    logging(LOG_INFO, "scheduler", "forked %s as pid=%d\n", pcb[idx].name, pcb[idx].pid);
+
+    list_init(&pcb[idx].wait_list);
+    spin_lock_acquire(&sched_lock);
+    ready_enqueue(&pcb[idx]);
+    spin_lock_release(&sched_lock);
+    return pcb[idx].pid;
+
+nomem:
+    logging(LOG_ERROR, "scheduler", "fork: out of memory\n");
+    put_pcb_idx(idx);
+    return -1;
+}
+
+static void schedule(void) {
+    // called with sched_lock held, which is released by the next task
+    // after switch_to(), in __do_scheduler() or ret_from_fork
     int cid = get_current_cpu_id();
 
     // Check sleep/send/recv queue to wake up PCBs
@@ -239,32 +488,41 @@ void do_scheduler(void) {
     // check_net_recv();
 
     pcb_t *prev = current_running[cid];
-    pcb_t *next = pcb_dequeue(&ready_queue, 1 << cid);
+    uint64_t now = get_ticks();
+#ifdef SCHED_FAIR
+    if (prev->pid != 0)
+        update_vruntime(prev, now);
+#endif
+    // put prev back first, it keeps running if it's still the one to pick
+    if (prev->status == TASK_RUNNING) {
+        prev->status = TASK_READY;
+        if (prev->pid != 0)
+            ready_enqueue(prev);
+    }
+    pcb_t *next = pick_next(cid);
     if (next == NULL) {
-        if (current_running[cid]->status == TASK_RUNNING) {
-            logging(LOG_VV, "scheduler", "ready_queue empty, back to %d.%s.%d\n", prev->pid, prev->name, prev->tid);
-            return ;
-        } else if (pid0_pcb[0].status == TASK_READY) {
-            logging(LOG_VV, "scheduler", "ready_queue empty, use 0.init.0\n");
-            next = &pid0_pcb[0];
-        } else if (pid0_pcb[1].status == TASK_READY) {
-            logging(LOG_VV, "scheduler", "ready_queue empty, use 0.init.1\n");
-            next = &pid0_pcb[1];
+        if (pid0_pcb[cid].status == TASK_READY) {
+            logging(LOG_VV, "scheduler", "ready_queue empty, use 0.init.%d\n", cid);
+            next = &pid0_pcb[cid];
         } else{
             logging(LOG_CRITICAL, "scheduler", "ready_queue empty, kernel not ready yet\n");
             assert(0);
         }
     }
-
-    logging(LOG_VV, "scheduler", "%d.%s.%d -> %d.%s.%d\n", prev->pid, prev->name, prev->tid, next->pid, next->name, next->tid);
-
-    if (prev->status == TASK_RUNNING) {
-        prev->status = TASK_READY;
-        if (prev->pid != 0)
-            pcb_enqueue(&ready_queue, prev);
-    }
     next->status = TASK_RUNNING;
     next->cid = cid;
+    next->exec_start = now;
+    set_next_timer(cid, next, now);
+#ifdef SCHED_FAIR
+    if (next->pid != 0 && next->vruntime > min_vruntime[cid])
+        min_vruntime[cid] = next->vruntime;
+#endif
+    if (next == prev) {
+        logging(LOG_VV, "scheduler", "back to %d.%s.%d\n", prev->pid, prev->name, prev->tid);
+        return ;
+    }
+
+    logging(LOG_VV, "scheduler", "%d.%s.%d -> %d.%s.%d\n", prev->pid, prev->name, prev->tid, next->pid, next->name, next->tid);
 
     // Modify the current_running pointer.
     process_id = prev->pid;
@@ -279,36 +537,74 @@ void do_scheduler(void) {
     switch_to(prev, current_running[cid]);
 }
 
+static void __do_scheduler(pcb_t *self) {
+    // the lock of the syscall is not held while the task is switched out,
+    // it must be dropped after sched_lock is taken, or a waker may put self
+    // to ready_queue and let another hart run it on this very stack
+    spin_lock_t *held = self->lock;
+    if (held != NULL)
+        spin_lock_release(held);
+    schedule();
+    spin_lock_release(&sched_lock);
+    if (held != NULL)
+        spin_lock_acquire(held);
+}
+
+void do_scheduler(void) {
+    pcb_t *self = current_running[get_current_cpu_id()];
+    spin_lock_acquire(&sched_lock);
+    __do_scheduler(self);
+}
+
+static void sleep_until(uint64_t wakeup_time) {
+    pcb_t *self = current_running[get_current_cpu_id()];
+    // set the wake up time for the blocked task
+    self->wakeup_time = wakeup_time;
+    logging(LOG_INFO, "timer", "set wakeup time %d for %d.%s.%d\n", self->wakeup_time, self->pid, self->name, self->tid);
+    spin_lock_acquire(&sched_lock);
+    if (self->status != TASK_EXITED) {
+        sleep_enqueue(self);
+        self->status = TASK_BLOCKED;
+    }
+    // schedule() sets the timer for it
+    __do_scheduler(self);
+}
+
 void do_sleep(uint32_t sleep_time) {
-    int cid = get_current_cpu_id();
     // sleep(seconds)
     // NOTE: you can assume: 1 second = 1 `timebase` ticks
-    // set the wake up time for the blocked task
-    current_running[cid]->wakeup_time = get_ticks() + sleep_time * time_base;
-    logging(LOG_INFO, "timer", "set wakeup time %d for %d.%s.%d\n",
-            current_running[cid]->wakeup_time, current_running[cid]->pid, current_running[cid]->name, current_running[cid]->tid);
-    // call do_block
-    do_block(current_running[cid], &sleep_queue);
+    sleep_until(get_ticks() + sleep_time * time_base);
+}
+
+void do_usleep(uint64_t usec) {
+    sleep_until(get_ticks() + usec * time_base / 1000000);
 }
 
 void do_block(pcb_t *pcb, list_head *queue) {
     // block the pcb task into the block queue
     logging(LOG_INFO, "scheduler", "block %d.%s.%d\n", pcb->pid, pcb->name, pcb->tid);
-    pcb_enqueue(queue, pcb);
-    pcb->status = TASK_BLOCKED;
-    do_scheduler();
+    spin_lock_acquire(&sched_lock);
+    // killed by another hart, never wake up
+    if (pcb->status != TASK_EXITED) {
+        pcb_enqueue(queue, pcb);
+        pcb->status = TASK_BLOCKED;
+    }
+    __do_scheduler(pcb);
 }
 
 void do_unblock(list_head *queue) {
     // unblock the `pcb` from the block queue
+    spin_lock_acquire(&sched_lock);
     pcb_t *pcb = pcb_dequeue(queue, 0xFFFF);
     if (pcb == NULL) {
+        spin_lock_release(&sched_lock);
         logging(LOG_ERROR, "scheduler", "failed to unblock from queue %x\n", queue);
         return ;
     }
-    logging(LOG_INFO, "scheduler", "unblock %d.%s.%d\n", pcb->pid, pcb->name, pcb->tid);
     pcb->status = TASK_READY;
-    pcb_enqueue(&ready_queue, pcb);
+    ready_enqueue(pcb);
+    spin_lock_release(&sched_lock);
+    logging(LOG_INFO, "scheduler", "unblock %d.%s.%d\n", pcb->pid, pcb->name, pcb->tid);
 }
 
 void do_exit(void) {
@@ -343,10 +639,18 @@ int do_kill(pid_t pid) {
             // forced release all locks, this will do nothing if proc doesnt hold any lock
             do_mutex_lock_release_f(pcb[i].pid, pcb[i].tid);
             // barrier & mbox will not be released by kernel
+            // close opened files, threads share them with process
+            if (pcb[i].type == TYPE_PROCESS) {
+                munmap_all(&pcb[i]);
+                close_all_files(pcb[i].fdtable);
+            }
             // do kill
+            spin_lock_acquire(&sched_lock);
             pcb[i].status = TASK_EXITED;
             // remove pcb from any queue, this will do nothing if pcb is not in a queue
             list_delete(&pcb[i].list);
+            sleep_dequeue(&pcb[i]);
+            spin_lock_release(&sched_lock);
             // return success
             retval = 1;
             // log
@@ -383,8 +687,8 @@ void do_process_show(int mode) {
         "READY  ",
         "EXITED "
     };
-    printk("--------------------- PROCESS TABLE START ---------------------\n");
-    printk("| idx | PID | TID | name             | status  | cpu |  mask  |\n");
+    printk("------------------------ PROCESS TABLE START ------------------------\n");
+    printk("| idx | PID | TID | name             | status  | cpu |  mask  | nice |\n");
     for (int i=0; i<NUM_MAX_TASK; i++) {
         if (pcb[i].status == TASK_UNUSED)
             break;
@@ -396,11 +700,11 @@ void do_process_show(int mode) {
         strncpy(buf, pcb[i].name, len<16 ? len : 16);
         if (len > 16)
             buf[13] = buf[14] = buf[15] = '.';
-        printk("| %03d | %03d | %03d | %s | %s |  %c  | 0x%04x |\n",
+        printk("| %03d | %03d | %03d | %s | %s |  %c  | 0x%04x | %4d |\n",
                i, pcb[i].pid, pcb[i].tid, buf, status_dict[pcb[i].status],
-               pcb[i].status == TASK_RUNNING ? pcb[i].cid + '0' : '-', pcb[i].mask);
+               pcb[i].status == TASK_RUNNING ? pcb[i].cid + '0' : '-', pcb[i].mask, pcb[i].nice);
     }
-    printk("---------------------- PROCESS TABLE END ----------------------\n");
+    printk("------------------------- PROCESS TABLE END -------------------------\n");
 }
 
 pid_t do_getpid(void) {
@@ -412,7 +716,37 @@ void do_taskset(pid_t pid, unsigned mask) {
     for (int i=0; i<NUM_MAX_TASK; i++) {
         if (pcb[i].status == TASK_UNUSED)
             break;
-        if (pcb[i].pid == pid && pcb[i].status != TASK_EXITED)
+        if (pcb[i].pid == pid && pcb[i].status != TASK_EXITED) {
+            spin_lock_acquire(&sched_lock);
             pcb[i].mask = mask;
+            // move it to a hart it's allowed on
+            if (pcb[i].status == TASK_READY) {
+                list_delete(&pcb[i].list);
+                ready_enqueue(&pcb[i]);
+            }
+            spin_lock_release(&sched_lock);
+        }
+    }
+}
+
+int do_setpriority(pid_t pid, int nice) {
+    // set nice of the process and its threads, returns the number of them
+    int retval = 0;
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+    for (int i=0; i<NUM_MAX_TASK; i++) {
+        if (pcb[i].status == TASK_UNUSED)
+            break;
+        if (pcb[i].pid == pid && pcb[i].status != TASK_EXITED) {
+            // read by schedule() when it accounts vruntime
+            spin_lock_acquire(&sched_lock);
+            pcb[i].nice = nice;
+            spin_lock_release(&sched_lock);
+            retval ++;
+        }
     }
+    logging(LOG_INFO, "scheduler", "set nice of pid=%d to %d, %d tasks\n", pid, nice, retval);
+    return retval;
 }
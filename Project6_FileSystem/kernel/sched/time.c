@@ -1,13 +1,12 @@
 #include <os/list.h>
 #include <os/sched.h>
+#include <os/time.h>
 #include <type.h>
 #include <printk.h>
 
 uint64_t time_elapsed = 0;
 uint64_t time_base = 0;
 
-void pcb_enqueue(list_node_t *queue, pcb_t *pcb);
-
 uint64_t get_ticks()
 {
     __asm__ __volatile__(
@@ -34,18 +33,70 @@ void latency(uint64_t time)
     return;
 }
 
+/* sleep heap: sleep_heap[1] wakes up first, pcb->sleep_idx is its index */
+static pcb_t *sleep_heap[NUM_MAX_TASK + 1];
+static int sleep_num = 0;
+
+static void sleep_heap_set(int idx, pcb_t *pcb) {
+    sleep_heap[idx] = pcb;
+    pcb->sleep_idx = idx;
+}
+
+static void sleep_heap_up(int idx) {
+    pcb_t *pcb = sleep_heap[idx];
+    while (idx > 1 && sleep_heap[idx / 2]->wakeup_time > pcb->wakeup_time) {
+        sleep_heap_set(idx, sleep_heap[idx / 2]);
+        idx /= 2;
+    }
+    sleep_heap_set(idx, pcb);
+}
+
+static void sleep_heap_down(int idx) {
+    pcb_t *pcb = sleep_heap[idx];
+    while (idx * 2 <= sleep_num) {
+        int child = idx * 2;
+        if (child < sleep_num && sleep_heap[child + 1]->wakeup_time < sleep_heap[child]->wakeup_time)
+            child ++;
+        if (sleep_heap[child]->wakeup_time >= pcb->wakeup_time)
+            break;
+        sleep_heap_set(idx, sleep_heap[child]);
+        idx = child;
+    }
+    sleep_heap_set(idx, pcb);
+}
+
+void sleep_enqueue(pcb_t *pcb) {
+    sleep_heap_set(++sleep_num, pcb);
+    sleep_heap_up(sleep_num);
+}
+
+void sleep_dequeue(pcb_t *pcb) {
+    // do nothing if pcb is not sleeping
+    int idx = pcb->sleep_idx;
+    if (idx == 0)
+        return ;
+    pcb->sleep_idx = 0;
+    pcb_t *last = sleep_heap[sleep_num--];
+    if (last == pcb)
+        return ;
+    sleep_heap_set(idx, last);
+    sleep_heap_up(idx);
+    sleep_heap_down(last->sleep_idx);
+}
+
+uint64_t next_wakeup(void) {
+    return sleep_num > 0 ? sleep_heap[1]->wakeup_time : (uint64_t) -1;
+}
+
 void check_sleeping(void)
 {
-    // Pick out tasks that should wake up from the sleep queue
-    for (list_node_t *p=sleep_queue.next; p!=&sleep_queue; ) {
-        pcb_t *pcb = list_entry(p, pcb_t, list);
-        if (pcb->wakeup_time <= get_ticks()) {
-            logging(LOG_INFO, "timer", "wakeup %d.%s.%d, expected at %d\n", pcb->pid, pcb->name, pcb->tid, pcb->wakeup_time);
-            p = list_delete(p);
-            pcb->status = TASK_READY;
-            pcb_enqueue(&ready_queue, pcb);
-        } else {
-            p = p->next;
-        }
+    // Pick out tasks that should wake up from the sleep heap
+    uint64_t now = get_ticks();
+    while (sleep_num > 0 && sleep_heap[1]->wakeup_time <= now) {
+        pcb_t *pcb = sleep_heap[1];
+        logging(LOG_INFO, "timer", "wakeup %d.%s.%d, expected at %d\n", pcb->pid, pcb->name, pcb->tid, pcb->wakeup_time);
+        sleep_dequeue(pcb);
+        pcb->status = TASK_READY;
+        ready_enqueue(pcb);
     }
 }
@@ -1,6 +1,9 @@
 #include <sys/syscall.h>
+#include <os/fs.h>
+#include <os/smp.h>
 
 long (*syscall[NUM_SYSCALLS])();
+spin_lock_t *syscall_lock[NUM_SYSCALLS];
 
 void handle_syscall(regs_context_t *regs, uint64_t interrupt, uint64_t cause)
 {
@@ -11,6 +14,14 @@ void handle_syscall(regs_context_t *regs, uint64_t interrupt, uint64_t cause)
 
     regs->sepc += 4;
     long (*fn)() = syscall[regs->regs[17]];
+    spin_lock_t *lock = syscall_lock[regs->regs[17]];
+    if (lock != NULL)
+        task_lock(lock);
     long retval = fn(regs->regs[10], regs->regs[11], regs->regs[12], regs->regs[13], regs->regs[14]);
+    // fs operations run whole under mm_lock, a transaction may end here
+    if (lock == &mm_lock)
+        fs_commit_point();
+    if (lock != NULL)
+        task_unlock(lock);
     regs->regs[10] = retval;
 }
@@ -249,8 +249,10 @@ static int _vprint(const char *fmt, va_list _va,
 
 static void _output_wrapper(char *buff)
 {
+    spin_lock_acquire(&screen_lock);
     screen_write(buff);
     screen_reflush();
+    spin_lock_release(&screen_lock);
 }
 
 static int vprintk(const char *fmt, va_list _va)
@@ -346,7 +348,9 @@ int logging(loglevel_t level, const char* name, const char *fmt, ...)
 
     // print to screen
     if (level >= __print_level) {
+        spin_lock_acquire(&screen_lock);
         screen_write(buf);
+        spin_lock_release(&screen_lock);
         vprintk(fmt, va);
     }
 
@@ -11,6 +11,7 @@
 
 #define LS_OPTIONS_L 0x1
 #define LS_OPTIONS_A 0x2
+#define MKFS_OPTIONS_E 0x1
 
 pid_t self;
 char history[HISTSIZE][BUFSIZE];
@@ -222,6 +223,7 @@ int main(void) {
             printf("  history: show cmd history\n");
             printf("  ts: show tasks\n");
             printf("  taskset -p mask pid / taskset mask name [arg0] ...: set pid's mask\n");
+            printf("  renice nice pid: set pid's nice, -20 ~ 19\n");
             printf("  shortcut keys:\n");
             printf("     Ctrl+C: clear line\n");
             printf("     Ctrl+D: exit shell\n");
@@ -294,7 +296,10 @@ int main(void) {
             }
             sys_mkdir(argv[1]);
         } else if (strcmp("mkfs", argv[0]) == 0) {
-            sys_mkfs();
+            int option = 0;
+            if (argc >= 2 && strcmp("-e", argv[1]) == 0)
+                option |= MKFS_OPTIONS_E;
+            sys_mkfs(option);
         } else if (strcmp("ps", argv[0]) == 0) {
             int mode = 0;
             if (argc >= 2 && strcmp("-v", argv[1]) == 0)
@@ -314,6 +319,8 @@ int main(void) {
             sys_rmdir(argv[1]);
         } else if (strcmp("statfs", argv[0]) == 0) {
             sys_statfs();
+        } else if (strcmp("sync", argv[0]) == 0) {
+            sys_sync();
 #ifndef S_CORE_P3
         } else if (strcmp("taskset", argv[0]) == 0) {
             unsigned mask;
@@ -329,6 +336,17 @@ int main(void) {
             sys_taskset(pid, mask);
             printf("Set pid=%d's mask=0x%04x\n", pid, mask);
 #endif
+        } else if (strcmp("renice", argv[0]) == 0) {
+            if (argc < 3) {
+                printf("Error: nice and pid can't be empty\nUsage: renice nice pid\n");
+                continue;
+            }
+            int nice = atoi(argv[1]);
+            pid_t pid = atoi(argv[2]);
+            if (sys_setpriority(pid, nice) == 0)
+                printf("Error: pid=%d not found\n", pid);
+            else
+                printf("Set pid=%d's nice=%d\n", pid, nice);
         } else if (strcmp("touch", argv[0]) == 0) {
             if (argc == 1) {
                 printf("Error: path can't be empty\nUsage: touch path\n");
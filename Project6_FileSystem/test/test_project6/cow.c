@@ -0,0 +1,54 @@
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define PAGE_SIZE 0x1000
+#define COW_PAGES 4
+#define INTS (COW_PAGES * PAGE_SIZE / sizeof(int))
+
+// written before fork, then shared read only until one side stores
+static int data[INTS];
+
+static void fill(int value) {
+    for (int i = 0; i < INTS; i += PAGE_SIZE / sizeof(int))
+        data[i] = value + i;
+}
+
+static void check(int value) {
+    for (int i = 0; i < INTS; i += PAGE_SIZE / sizeof(int))
+        assert(data[i] == value + i);
+}
+
+int main(void)
+{
+    sys_move_cursor(0, 0);
+    int local = 1;
+    fill(1);
+
+    pid_t pid = sys_fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        // child: sees the data before fork, its stores are its own
+        check(1);
+        assert(local == 1);
+        fill(2);
+        local = 2;
+        sys_sleep(1);
+        check(2);
+        assert(local == 2);
+        sys_move_cursor(0, 1);
+        printf("child: copy on write ok\n");
+        return 0;
+    }
+
+    // parent: stores while the child still shares the frames
+    fill(3);
+    local = 3;
+    sys_waitpid(pid);
+    check(3);
+    assert(local == 3);
+    sys_move_cursor(0, 2);
+    printf("parent: copy on write ok\n");
+    printf("Success!\n");
+    return 0;
+}
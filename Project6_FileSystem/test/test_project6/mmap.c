@@ -0,0 +1,67 @@
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define PAGE_SIZE 0x1000
+// more than PAGEFRAME_LIMIT leaves to user pages, so mapped pages are reclaimed
+#define MMAP_PAGES 32
+
+static char buff[PAGE_SIZE];
+
+int main(void)
+{
+    sys_move_cursor(0, 0);
+    int fd = sys_fopen("mmap.txt", O_RDWR);
+    assert(fd >= 0);
+
+    // the file must be as large as the mapping, mmap never extends it
+    printf("write");
+    for (int i = 0; i < MMAP_PAGES; i++) {
+        for (int j = 0; j < PAGE_SIZE; j++)
+            buff[j] = 'a' + i % 26;
+        assert(sys_fwrite(fd, buff, PAGE_SIZE) == PAGE_SIZE);
+        printf(".");
+    }
+
+    // read through the mapping, store to every page
+    printf("\nmmap ");
+    char *p = (char *) sys_mmap(fd, 0, MMAP_PAGES * PAGE_SIZE);
+    assert(p != 0);
+    for (int i = 0; i < MMAP_PAGES; i++) {
+        char *page = p + i * PAGE_SIZE;
+        assert(page[0] == 'a' + i % 26 && page[PAGE_SIZE - 1] == 'a' + i % 26);
+        page[0] = 'A' + i % 26;
+        page[PAGE_SIZE - 1] = 'A' + i % 26;
+        printf(".");
+    }
+    // pages reclaimed on the way are loaded again with the stores
+    for (int i = 0; i < MMAP_PAGES; i++)
+        assert(p[i * PAGE_SIZE] == 'A' + i % 26);
+
+    // msync makes the stores visible to fread
+    printf("\nmsync ");
+    assert(sys_msync(p) == 0);
+    sys_lseek(fd, 0, SEEK_SET);
+    for (int i = 0; i < MMAP_PAGES; i++) {
+        assert(sys_fread(fd, buff, PAGE_SIZE) == PAGE_SIZE);
+        assert(buff[0] == 'A' + i % 26 && buff[1] == 'a' + i % 26);
+        assert(buff[PAGE_SIZE - 1] == 'A' + i % 26);
+        printf(".");
+    }
+
+    // munmap writes back what is still dirty
+    printf("\nmunmap ");
+    p[1] = '!';
+    assert(sys_munmap(p) == 0);
+    sys_lseek(fd, 1, SEEK_SET);
+    assert(sys_fread(fd, buff, 1) == 1 && buff[0] == '!');
+
+    // a mapping from the middle of the file
+    p = (char *) sys_mmap(fd, 2 * PAGE_SIZE, PAGE_SIZE);
+    assert(p != 0 && p[0] == 'C' && p[1] == 'c');
+    assert(sys_munmap(p) == 0);
+
+    sys_fclose(fd);
+    printf("\nSuccess!\n");
+    return 0;
+}
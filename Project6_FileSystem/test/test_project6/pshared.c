@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define SHM_KEY 2024
+#define ROUNDS 1000
+
+// lives in a shm page, the child attaches it again at another va
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_barrier_t barrier;
+    int counter;
+    int ready;
+} shared_t;
+
+static void count(shared_t *s) {
+    for (int i = 0; i < ROUNDS; i++) {
+        pthread_mutex_lock(&s->mutex);
+        s->counter++;
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+int main(void)
+{
+    sys_move_cursor(0, 0);
+    shared_t *s = (shared_t *) sys_shmpageget(SHM_KEY);
+    pthread_mutex_init(&s->mutex);
+    pthread_cond_init(&s->cond);
+    pthread_barrier_init(&s->barrier, 2);
+    s->counter = 0;
+    s->ready = 0;
+
+    pid_t pid = sys_fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        shared_t *t = (shared_t *) sys_shmpageget(SHM_KEY);
+        assert(t != s);
+        count(t);
+        pthread_barrier_wait(&t->barrier);
+
+        // wait for the parent to see the total
+        pthread_mutex_lock(&t->mutex);
+        while (!t->ready)
+            pthread_cond_wait(&t->cond, &t->mutex);
+        pthread_mutex_unlock(&t->mutex);
+        sys_move_cursor(0, 1);
+        printf("child: signaled, counter=%d\n", t->counter);
+
+        pthread_barrier_wait(&t->barrier);
+        sys_shmpagedt(t);
+        return 0;
+    }
+
+    count(s);
+    pthread_barrier_wait(&s->barrier);
+    assert(s->counter == 2 * ROUNDS);
+    printf("parent: counter=%d\n", s->counter);
+
+    pthread_mutex_lock(&s->mutex);
+    s->ready = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+
+    pthread_barrier_wait(&s->barrier);
+    sys_waitpid(pid);
+    sys_shmpagedt(s);
+    sys_move_cursor(0, 2);
+    printf("Success!\n");
+    return 0;
+}
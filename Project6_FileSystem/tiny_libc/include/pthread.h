@@ -9,4 +9,37 @@ void pthread_create(pthread_t *thread,
 int pthread_join(pthread_t thread);
 void pthread_exit();
 
-#endif
\ No newline at end of file
+/* mutex, condition and barrier in user memory, they only trap to sleep / wake on contention
+ * threads share them anywhere, processes share them in a shm page (sys_shmpageget)
+ */
+#define PTHREAD_SPIN 100  // tries before sleeping in the kernel
+
+typedef struct {
+    volatile uint32_t state;  // 0: unlocked, 1: locked, 2: locked and may have waiters
+} pthread_mutex_t;
+
+typedef struct {
+    volatile uint32_t seq;
+    volatile uint32_t waiters;
+} pthread_cond_t;
+
+typedef struct {
+    volatile uint32_t count;
+    volatile uint32_t goal;
+    volatile uint32_t gen;
+} pthread_barrier_t;
+
+void pthread_mutex_init(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+void pthread_mutex_lock(pthread_mutex_t *mutex);
+void pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+void pthread_cond_init(pthread_cond_t *cond);
+void pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+void pthread_cond_signal(pthread_cond_t *cond);
+void pthread_cond_broadcast(pthread_cond_t *cond);
+
+void pthread_barrier_init(pthread_barrier_t *barrier, int goal);
+void pthread_barrier_wait(pthread_barrier_t *barrier);
+
+#endif
@@ -82,5 +82,22 @@ static inline long atomic_exchange_d(volatile void* obj, long desired)
     return ret;
 }
 
+/* if *obj == expected, then *obj = desired, return the old *obj */
+static inline int atomic_compare_exchange(volatile void* obj, int expected, int desired)
+{
+    int ret;
+    register unsigned int rc;
+    __asm__ __volatile__ (
+        "0:\tlr.w %0, %2\n"
+        "\tbne  %0, %z3, 1f\n"
+        "\tsc.w.rl %1, %z4, %2\n"
+        "\tbnez %1, 0b\n"
+        "\tfence rw, rw\n"
+        "1:\n"
+        : "=&r"(ret), "=&r"(rc), "+A" (*(uint32_t*)obj)
+        : "rJ"(expected), "rJ"(desired)
+        : "memory");
+    return ret;
+}
 
 #endif /* ATOMIC_H */
@@ -12,6 +12,8 @@
 #define SEEK_SET 0
 #define SEEK_CUR 1
 #define SEEK_END 2
+#define SEEK_DATA 3  /* next offset with data */
+#define SEEK_HOLE 4  /* next offset in a hole */
 
 int printf(const char *fmt, ...);
 int vprintf(const char *fmt, va_list va);
@@ -7,6 +7,7 @@ typedef pid_t pthread_t;
 
 /* sleep */
 void sys_sleep(uint32_t time);
+void sys_usleep(uint64_t usec);
 
 /* yield */
 void sys_yield(void);
@@ -53,6 +54,9 @@ pid_t sys_exec(int id, int argc, uint64_t arg0, uint64_t arg1, uint64_t arg2);
 pid_t sys_exec(char *name, int argc, char **argv);
 #endif
 
+/* fork, returns 0 in child */
+pid_t sys_fork(void);
+
 /* exit, kill, waitpid, getpid */
 void sys_exit(void);
 int sys_kill(pid_t pid);
@@ -80,6 +84,13 @@ int sys_mbox_recv(int mbox_idx, void *msg, int msg_length);
 /* smp */
 void sys_taskset(pid_t pid, unsigned mask);
 
+/* priority, nice is -20 ~ 19, lower runs more */
+int sys_setpriority(pid_t pid, int nice);
+
+/* futex, wait while *addr == val / wake num waiters of addr, see pthread.h */
+int sys_futex_wait(volatile uint32_t *addr, uint32_t val);
+int sys_futex_wake(volatile uint32_t *addr, int num);
+
 /* shmpageget/dt */
 void *sys_shmpageget(int key);
 void sys_shmpagedt(void *addr);
@@ -93,7 +104,7 @@ int sys_net_send(void *txpacket, int length);
 int sys_net_recv(void *rxbuffer, int pkt_num, int *pkt_lens);
 
 /* file system operations */
-int sys_mkfs(void);
+int sys_mkfs(int option);
 int sys_statfs(void);
 int sys_cd(char *path);
 int sys_mkdir(char *path);
@@ -108,5 +119,11 @@ int sys_fclose(int fd);
 int sys_ln(char *src_path, char *dst_path);
 int sys_rm(char *path);
 int sys_lseek(int fd, int offset, int whence);
+int sys_sync(void);
+
+/* mmap, offset must be page aligned */
+void *sys_mmap(int fd, int offset, int length);
+int sys_munmap(void *addr);
+int sys_msync(void *addr);
 
 #endif
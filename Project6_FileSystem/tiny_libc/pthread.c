@@ -1,5 +1,6 @@
 #include <pthread.h>
 #include <unistd.h>
+#include <stdatomic.h>
 
 void pthread_create(pthread_t *thread,
                    void (*start_routine)(void*),
@@ -14,3 +15,84 @@ int pthread_join(pthread_t thread) {
 void pthread_exit() {
     sys_pthread_exit();
 }
+
+void pthread_mutex_init(pthread_mutex_t *mutex) {
+    mutex->state = 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex) {
+    return atomic_compare_exchange(&mutex->state, 0, 1) == 0 ? 0 : -1;
+}
+
+static void mutex_lock_contended(pthread_mutex_t *mutex) {
+    // mark it contended, so that the owner wakes us in unlock
+    while (atomic_exchange(&mutex->state, 2) != 0)
+        sys_futex_wait(&mutex->state, 2);
+}
+
+void pthread_mutex_lock(pthread_mutex_t *mutex) {
+    // spin a little, the owner may be running on the other hart
+    for (int i=0; i<PTHREAD_SPIN; i++) {
+        int c = atomic_compare_exchange(&mutex->state, 0, 1);
+        if (c == 0)
+            return ;
+        if (c == 2)
+            break;
+    }
+    mutex_lock_contended(mutex);
+}
+
+void pthread_mutex_unlock(pthread_mutex_t *mutex) {
+    // no syscall unless someone has marked it contended
+    if (fetch_sub(&mutex->state, 1) != 1) {
+        atomic_exchange(&mutex->state, 0);
+        sys_futex_wake(&mutex->state, 1);
+    }
+}
+
+void pthread_cond_init(pthread_cond_t *cond) {
+    cond->seq = 0;
+    cond->waiters = 0;
+}
+
+void pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    fetch_add(&cond->waiters, 1);
+    uint32_t seq = cond->seq;
+    pthread_mutex_unlock(mutex);
+    // returns at once if signaled after the mutex is released
+    sys_futex_wait(&cond->seq, seq);
+    fetch_sub(&cond->waiters, 1);
+    // woken ones may race for the mutex, keep it contended
+    mutex_lock_contended(mutex);
+}
+
+void pthread_cond_signal(pthread_cond_t *cond) {
+    fetch_add(&cond->seq, 1);
+    if (cond->waiters > 0)
+        sys_futex_wake(&cond->seq, 1);
+}
+
+void pthread_cond_broadcast(pthread_cond_t *cond) {
+    fetch_add(&cond->seq, 1);
+    if (cond->waiters > 0)
+        sys_futex_wake(&cond->seq, INT32_MAX);
+}
+
+void pthread_barrier_init(pthread_barrier_t *barrier, int goal) {
+    barrier->count = 0;
+    barrier->goal = goal;
+    barrier->gen = 0;
+}
+
+void pthread_barrier_wait(pthread_barrier_t *barrier) {
+    uint32_t gen = barrier->gen;
+    if (fetch_add(&barrier->count, 1) + 1 == barrier->goal) {
+        // the last one starts the next generation
+        barrier->count = 0;
+        fetch_add(&barrier->gen, 1);
+        sys_futex_wake(&barrier->gen, INT32_MAX);
+    } else {
+        while (barrier->gen == gen)
+            sys_futex_wait(&barrier->gen, gen);
+    }
+}
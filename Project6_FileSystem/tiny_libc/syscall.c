@@ -119,6 +119,11 @@ void sys_sleep(uint32_t time)
     invoke_syscall(SYSCALL_SLEEP, time, IGNORE, IGNORE, IGNORE, IGNORE);
 }
 
+void sys_usleep(uint64_t usec)
+{
+    invoke_syscall(SYSCALL_USLEEP, usec, IGNORE, IGNORE, IGNORE, IGNORE);
+}
+
 pid_t sys_pthread_create(uint64_t entrypoint, void *arg) {
     return invoke_syscall(SYSCALL_PTHREAD_CREATE, entrypoint, (long) arg, IGNORE, IGNORE, IGNORE);
 }
@@ -147,6 +152,11 @@ pid_t sys_exec(char *name, int argc, char **argv)
 }
 #endif
 
+pid_t sys_fork(void)
+{
+    return invoke_syscall(SYSCALL_FORK, IGNORE, IGNORE, IGNORE, IGNORE, IGNORE);
+}
+
 void sys_exit(void)
 {
     /* call invoke_syscall to implement sys_exit */
@@ -259,6 +269,18 @@ void sys_taskset(pid_t pid, unsigned mask) {
     invoke_syscall(SYSCALL_TASKSET, pid, mask, IGNORE, IGNORE, IGNORE);
 }
 
+int sys_setpriority(pid_t pid, int nice) {
+    return invoke_syscall(SYSCALL_SETPRIORITY, pid, nice, IGNORE, IGNORE, IGNORE);
+}
+
+int sys_futex_wait(volatile uint32_t *addr, uint32_t val) {
+    return invoke_syscall(SYSCALL_FUTEX_WAIT, (long) addr, val, IGNORE, IGNORE, IGNORE);
+}
+
+int sys_futex_wake(volatile uint32_t *addr, int num) {
+    return invoke_syscall(SYSCALL_FUTEX_WAKE, (long) addr, num, IGNORE, IGNORE, IGNORE);
+}
+
 void *sys_shmpageget(int key) {
     return (void *) invoke_syscall(SYSCALL_SHM_GET, key, IGNORE, IGNORE, IGNORE, IGNORE);
 }
@@ -283,8 +305,8 @@ int sys_net_recv(void *rxbuffer, int pkt_num, int *pkt_lens) {
     return invoke_syscall(SYSCALL_NET_RECV, (long) rxbuffer, pkt_num, (long) pkt_lens, IGNORE, IGNORE);
 }
 
-int sys_mkfs(void) {
-    return invoke_syscall(SYSCALL_FS_MKFS, IGNORE, IGNORE, IGNORE, IGNORE, IGNORE);
+int sys_mkfs(int option) {
+    return invoke_syscall(SYSCALL_FS_MKFS, option, IGNORE, IGNORE, IGNORE, IGNORE);
 }
 
 int sys_statfs(void){
@@ -343,3 +365,19 @@ int sys_rm(char *path) {
 int sys_lseek(int fd, int offset, int whence) {
     return invoke_syscall(SYSCALL_FS_LSEEK, fd, offset, whence, IGNORE, IGNORE);
 }
+
+int sys_sync(void) {
+    return invoke_syscall(SYSCALL_FS_SYNC, IGNORE, IGNORE, IGNORE, IGNORE, IGNORE);
+}
+
+void *sys_mmap(int fd, int offset, int length) {
+    return (void *) invoke_syscall(SYSCALL_MMAP, fd, offset, length, IGNORE, IGNORE);
+}
+
+int sys_munmap(void *addr) {
+    return invoke_syscall(SYSCALL_MUNMAP, (long) addr, IGNORE, IGNORE, IGNORE, IGNORE);
+}
+
+int sys_msync(void *addr) {
+    return invoke_syscall(SYSCALL_MSYNC, (long) addr, IGNORE, IGNORE, IGNORE, IGNORE);
+}